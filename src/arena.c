@@ -1,11 +1,14 @@
 
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <stddef.h>
-#include "arena.h"
+#include <sched.h>
+#include "yoink.h"
+#include "ptrhashtable2.h"
 #include "resizable_buf.h"
 
 
@@ -16,44 +19,627 @@ void _arena_add_link(Arena *arena, struct chain *chain)
                 chain->next = orig;
         } while (!atomic_compare_exchange_weak(&arena->chain, &orig, chain));
 }
-void *arena_malloc(Arena *arena, size_t size)
+static struct slab *
+slab_new(size_t size)
 {
-        size = _ARENA_RUP(size) * sizeof(void *); // round up
-//        printf("arena_alloc(_,%i,%i,%i)\n", tsz, bptrs, eptrs);
-        size_t needed = sizeof(struct chain) + size;
-        struct chain *chain = malloc(needed);
+        struct slab *s = calloc(1, sizeof(struct slab) + size);
+        if (!s) {
+                fprintf(stderr, "arena slab error: %s", strerror(errno));
+                abort();
+        }
+        s->size = size;
+        atomic_init(&s->used, 0);
+        atomic_init(&s->end, size);
+        return s;
+}
+
+static void
+slab_link(struct slab *_Atomic *list, struct slab *s)
+{
+        struct slab *orig = atomic_load(list);
+        do {
+                s->next = orig;
+        } while (!atomic_compare_exchange_weak(list, &orig, s));
+}
+
+void _arena_add_slab(Arena *arena, struct slab *s)
+{
+        slab_link(&arena->slabs, s);
+}
+
+/* carve need bytes out of the current slab, starting a new one when it fills
+ * up. The thread whose request straddles the end of a slab records where
+ * carving stopped so the slab can be walked later. */
+static void *
+slab_bump(Arena *arena, size_t need)
+{
+        struct slab *s = atomic_load(&arena->bump);
+        for (;;) {
+                if (s) {
+                        size_t off = atomic_fetch_add(&s->used, need);
+                        if (off + need <= s->size)
+                                return (char *)s->data + off;
+                        if (off <= s->size)
+                                atomic_store(&s->end, off);
+                }
+                struct slab *n = slab_new(arena->slab_size);
+                if (atomic_compare_exchange_strong(&arena->bump, &s, n)) {
+                        slab_link(&arena->slabs, n);
+                        s = n;
+                } else
+                        free(n);
+        }
+}
+
+/* what arena_vacuums_lazy left to sweep. while marking, objects are marked in
+ * a bitmap for each region of memory anything was marked in rather than in
+ * their headers, so nothing has to go back over them to clear their marks,
+ * whether they are in the arena or not. once marking is done slabs with
+ * something live in them are linked straight back into the arena and only the
+ * dead ones wait here, chains are taken out of the arena and linked back in as
+ * they are swept and found live. */
+struct arena_sweep {
+        struct chain *chain;            // chains left to sweep
+        struct slab *slabs;             // slabs while marking, then dead slabs left to free
+        HashTable regions;              // mark bitmap of each region
+        uintptr_t region;               // region last looked up
+        uint64_t *marks;                // and its bitmap
+        struct slab **sorted;           // slabs sorted by address, only made if weak objects need it
+        size_t nsorted;
+        HashTable chains;               // every chain, made along with sorted
+        bool made;
+        ssize_t credit;                 // bytes that may still be swept
+};
+
+/* allocating pays for sweeping, this many bytes are swept for each one
+ * allocated */
+#define ARENA_SWEEP_RATE 2
+
+/* marks are kept for each 64k of memory, one bit per word */
+#define SWEEP_REGION_BITS 16
+#define SWEEP_REGION_MASK (((uintptr_t)1 << SWEEP_REGION_BITS) - 1)
+
+static int
+slab_cmp(const void *a, const void *b)
+{
+        uintptr_t x = (uintptr_t)*(struct slab **)a, y = (uintptr_t)*(struct slab **)b;
+        return x < y ? -1 : x > y;
+}
+
+struct arena_sweep *
+_arena_sweep_begin(Arena *arena)
+{
+        _arena_index_drop(arena);
+        struct arena_sweep *sw = calloc(1, sizeof(*sw));
+        sw->regions = (HashTable)HASHMAP_INIT;
+        sw->chain = atomic_exchange(&arena->chain, NULL);
+        sw->slabs = atomic_exchange(&arena->slabs, NULL);
+        return sw;
+}
+
+/* the mark bitmap of the region holding p, made if it doesn't exist yet and
+ * make is set, else NULL */
+static uint64_t *
+sweep_marks(struct arena_sweep *sw, uintptr_t p, bool make)
+{
+        uintptr_t region = p >> SWEEP_REGION_BITS;
+        if (sw->marks && region == sw->region)
+                return sw->marks;
+        Value *v;
+        if (make) {
+                if (ht_ins(&sw->regions, region, &v)) {
+                        *v = (Value)calloc((SWEEP_REGION_MASK + 1) / sizeof(void *) / 64, sizeof(uint64_t));
+                        if (!*v) {
+                                fprintf(stderr, "arena sweep error: %s", strerror(errno));
+                                abort();
+                        }
+                }
+        } else if (!(v = ht_get(&sw->regions, region)))
+                return NULL;
+        sw->region = region;
+        return sw->marks = (uint64_t *)*v;
+}
+
+static bool
+sweep_marked(struct arena_sweep *sw, struct header *head)
+{
+        uint64_t *marks = sweep_marks(sw, (uintptr_t)head, false);
+        size_t w = ((uintptr_t)head & SWEEP_REGION_MASK) / sizeof(void *);
+        return marks && marks[w / 64] >> w % 64 & 1;
+}
+
+/* whether anything from p up to end is marked */
+static bool
+sweep_any(struct arena_sweep *sw, uintptr_t p, uintptr_t end)
+{
+        while (p < end) {
+                uintptr_t next = (p | SWEEP_REGION_MASK) + 1;
+                uint64_t *marks = sweep_marks(sw, p, false);
+                if (marks) {
+                        size_t lo = (p & SWEEP_REGION_MASK) / sizeof(void *);
+                        size_t hi = (((next < end ? next : end) - 1) & SWEEP_REGION_MASK) / sizeof(void *);
+                        for (size_t i = lo / 64; i <= hi / 64; i++) {
+                                uint64_t m = marks[i];
+                                if (i == lo / 64)
+                                        m &= ~(uint64_t)0 << lo % 64;
+                                if (i == hi / 64)
+                                        m &= ~(uint64_t)0 >> (63 - hi % 64);
+                                if (m)
+                                        return true;
+                        }
+                }
+                p = next;
+        }
+        return false;
+}
+
+bool
+_arena_sweep_mark(struct arena_sweep *sw, struct header *head)
+{
+        uint64_t *marks = sweep_marks(sw, (uintptr_t)head, true);
+        size_t w = ((uintptr_t)head & SWEEP_REGION_MASK) / sizeof(void *);
+        if (marks[w / 64] >> w % 64 & 1)
+                return false;
+        marks[w / 64] |= (uint64_t)1 << w % 64;
+        return true;
+}
+
+/* whether head is in one of the arena's slabs */
+static bool
+sweep_in_slab(struct arena_sweep *sw, struct header *head)
+{
+        size_t lo = 0, hi = sw->nsorted;
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if ((uintptr_t)sw->sorted[mid]->data <= (uintptr_t)head)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo && (uintptr_t)head - (uintptr_t)sw->sorted[lo - 1]->data < sw->sorted[lo - 1]->size;
+}
+
+bool
+_arena_sweep_dead(struct arena_sweep *sw, struct header *head)
+{
+        if (sweep_marked(sw, head))
+                return false;
+        /* unmarked objects of the arena are told from ones outside it by its
+         * slabs sorted by address and a set of its chains, made the first
+         * time they are needed */
+        if (!sw->made) {
+                rb_t sorted = RB_BLANK;
+                for (struct slab *s = sw->slabs; s; s = s->next)
+                        RB_PUSH(struct slab *, &sorted) = s;
+                sw->nsorted = RB_NITEMS(struct slab *, &sorted);
+                sw->sorted = rb_ptr(&sorted);
+                if (sw->nsorted)
+                        qsort(sw->sorted, sw->nsorted, sizeof(*sw->sorted), slab_cmp);
+                sw->chains = (HashTable)HASHSET_INIT;
+                for (struct chain *c = sw->chain; c; c = c->next)
+                        ht_add(&sw->chains, (uintptr_t)_CHAIN_HEAD(c));
+                sw->made = true;
+        }
+        return sweep_in_slab(sw, head) || ht_in(&sw->chains, (uintptr_t)head);
+}
+
+void
+_arena_sweep_start(Arena *arena, struct arena_sweep *sw)
+{
+        if (sw->made) {
+                free(sw->sorted);
+                ht_free(&sw->chains);
+        }
+        /* the slab being bumped is always kept */
+        struct slab *bump = atomic_load(&arena->bump);
+        struct slab *s = sw->slabs, *dead = NULL;
+        while (s) {
+                struct slab *next = s->next;
+                uintptr_t data = (uintptr_t)s->data;
+                if (s == bump || sweep_any(sw, data, data + s->size)) {
+                        slab_link(&arena->slabs, s);
+                } else {
+                        s->next = dead;
+                        dead = s;
+                }
+                s = next;
+        }
+        sw->slabs = dead;
+        atomic_store(&arena->sweep, sw);
+}
+
+/* sweep until budget bytes worth of blocks have been looked at, the caller
+ * holds sweeping. returns the bytes of objects freed. */
+static ssize_t
+sweep_blocks(Arena *arena, struct arena_sweep *sw, ssize_t budget)
+{
+        ssize_t freed = 0;
+        /* a step only stops early by running out of credit */
+        sw->credit += budget;
+        while (sw->credit > 0 && sw->chain) {
+                struct chain *c = sw->chain;
+                struct header *head = _CHAIN_HEAD(c);
+                sw->chain = c->next;
+                sw->credit -= sizeof(struct chain) + _head_tsz(head);
+                if (sweep_marked(sw, head)) {
+                        _arena_add_link(arena, c);
+                } else {
+                        freed += _head_tsz(head);
+                        free(c);
+                }
+        }
+        while (sw->credit > 0 && sw->slabs) {
+                struct slab *s = sw->slabs;
+                sw->slabs = s->next;
+                _SLAB_FOR(h, s)
+                        freed += _head_tsz(h);
+                sw->credit -= s->size;
+                free(s);
+        }
+        if (!sw->chain && !sw->slabs) {
+                atomic_store(&arena->sweep, NULL);
+                uintptr_t index = 0;
+                Value *v;
+                for (ht_next(&sw->regions, &index, &v); index; ht_next(&sw->regions, &index, &v))
+                        free((void *)*v);
+                ht_free(&sw->regions);
+                free(sw);
+        }
+        return freed;
+}
+
+/* sweep a step unless somebody else is */
+static ssize_t
+sweep_try(Arena *arena, ssize_t budget)
+{
+        if (atomic_exchange_explicit(&arena->sweeping, true, memory_order_acquire))
+                return 0;
+        struct arena_sweep *sw = atomic_load_explicit(&arena->sweep, memory_order_relaxed);
+        ssize_t freed = sw ? sweep_blocks(arena, sw, budget) : 0;
+        atomic_store_explicit(&arena->sweeping, false, memory_order_release);
+        return freed;
+}
+
+ssize_t
+arena_sweep_step(Arena *arena, size_t budget)
+{
+        if (!arena_sweep_pending(arena))
+                return 0;
+        return sweep_try(arena, budget > SSIZE_MAX ? SSIZE_MAX : budget);
+}
+
+bool
+arena_sweep_pending(Arena *arena)
+{
+        return atomic_load(&arena->sweep);
+}
+
+ssize_t
+_arena_sweep_finish(Arena *arena)
+{
+        ssize_t freed = 0;
+        while (arena_sweep_pending(arena))
+                freed += sweep_try(arena, SSIZE_MAX);
+        return freed;
+}
+
+struct header *
+_arena_alloc_header(Arena *arena, size_t tsz, size_t nptrs, size_t bptrs, bool zero)
+{
+        if (!tsz)
+                tsz = sizeof(void *);
+        size_t prefix = _head_prefix(tsz, nptrs, bptrs);
+        if (atomic_load_explicit(&arena->sweep, memory_order_relaxed))
+                sweep_try(arena, ARENA_SWEEP_RATE * (prefix + tsz));
+        if (arena->slab_size && tsz <= arena->slab_size / 8)
+                return _head_init(slab_bump(arena, prefix + tsz), tsz, nptrs, bptrs);
+        size_t needed = offsetof(struct chain, head) + prefix + tsz;
+        struct chain *chain = zero ? calloc(1, needed) : malloc(needed);
         if (!chain) {
-                fprintf(stderr, "arena_malloc error: %s", strerror(errno));
+                fprintf(stderr, "arena_alloc error: %s", strerror(errno));
                 abort();
         }
-        memset(chain, 0, sizeof(struct chain));
-        chain->head.tsz  = size;
+        struct header *head = _head_init(&chain->head, tsz, nptrs, bptrs);
         _arena_add_link(arena, chain);
-        return chain->data;
+        return head;
 }
 
-void arena_move(Arena *to, Arena *from)
+/* hand the current local slab over to the arena, marking where carving
+ * stopped. */
+static void
+local_publish(ArenaLocal *local)
 {
-        struct chain *orig = atomic_load(&from->chain);
-        while (!atomic_compare_exchange_weak(&from->chain, &orig, NULL));
-        struct chain *last = orig;
-        while (last->next)
-                last = last->next;
-        struct chain *torig =  atomic_load(&to->chain);
-        do {
-                last->next = torig;
-        } while (!atomic_compare_exchange_weak(&to->chain, &torig, orig));
+        struct slab *s = local->slab;
+        if (!s)
+                return;
+        size_t used = local->ptr - (char *)s->data;
+        atomic_store_explicit(&s->used, used, memory_order_relaxed);
+        atomic_store_explicit(&s->end, used, memory_order_relaxed);
+        slab_link(&local->arena->slabs, s);
+        local->slab = NULL;
+        local->ptr = local->end = NULL;
+}
+
+void
+arena_attach(ArenaLocal *local, Arena *arena)
+{
+        local->arena = arena;
+        local->slab = NULL;
+        local->ptr = local->end = NULL;
+}
+
+void
+arena_detach(ArenaLocal *local)
+{
+        local_publish(local);
+        local->arena = NULL;
+}
+
+struct header *
+_arena_local_header(ArenaLocal *local, size_t tsz, size_t nptrs, size_t bptrs, bool zero)
+{
+        if (!tsz)
+                tsz = sizeof(void *);
+        size_t need = _head_prefix(tsz, nptrs, bptrs) + tsz;
+        if ((size_t)(local->end - local->ptr) < need) {
+                size_t size = local->arena->slab_size ? local->arena->slab_size : ARENA_SLAB_SIZE;
+                if (tsz > size / 8)
+                        return _arena_alloc_header(local->arena, tsz, nptrs, bptrs, zero);
+                if (atomic_load_explicit(&local->arena->sweep, memory_order_relaxed))
+                        sweep_try(local->arena, ARENA_SWEEP_RATE * size);
+                local_publish(local);
+                local->slab = slab_new(size);
+                local->ptr = (char *)local->slab->data;
+                local->end = local->ptr + size;
+        }
+        struct header *head = _head_init(local->ptr, tsz, nptrs, bptrs);
+        local->ptr += need;
+        return head;
+}
+
+void *arena_local_malloc(ArenaLocal *local, size_t size)
+{
+        size = _ARENA_RUP(size) * sizeof(void *); // round up
+        return _arena_local_header(local, size, 0, 0, false)->data;
+}
+
+void *arena_malloc(Arena *arena, size_t size)
+{
+        size = _ARENA_RUP(size) * sizeof(void *); // round up
+        return _arena_alloc_header(arena, size, 0, 0, false)->data;
+}
+
+void arena_join(Arena *to, Arena *from)
+{
+        _arena_sweep_finish(from);
+        struct chain *orig = atomic_exchange(&from->chain, NULL);
+        if (orig) {
+                struct chain *last = orig;
+                while (last->next)
+                        last = last->next;
+                struct chain *torig =  atomic_load(&to->chain);
+                do {
+                        last->next = torig;
+                } while (!atomic_compare_exchange_weak(&to->chain, &torig, orig));
+        }
+        atomic_store(&from->bump, NULL);
+        _arena_index_drop(from);
+        struct slab *sorig = atomic_exchange(&from->slabs, NULL);
+        while (sorig) {
+                struct slab *next = sorig->next;
+                slab_link(&to->slabs, sorig);
+                sorig = next;
+        }
+}
+
+/* sorted address ranges of every block in an arena. new blocks are merged
+ * into the small recent run which is folded into main once it grows past an
+ * eighth of its size so refreshing is amortized over the blocks added. blocks
+ * are found by walking the lists from their heads up to the heads seen last
+ * time, since new blocks are always linked in at the head.
+ *
+ * an index is never changed once published, refreshing builds a new one
+ * sharing main with the old until it is folded and swaps it in. whoever
+ * refreshes holds the index, replaced ones are kept on the retired list of
+ * the current one and freed by a refresh that finds nobody holding it. */
+struct range {
+        uintptr_t lo, hi;
+};
+
+struct index_run {
+        size_t n;
+        struct range r[];
+};
+
+struct arena_index {
+        struct chain *chain;
+        struct slab *slabs;
+        struct index_run *main;         // shared with the indexes it replaced
+        bool owns_main;                 // main was folded after this was made
+        struct arena_index *retired;    // replaced indexes waiting to be freed
+        size_t nrecent;
+        struct range recent[];
+};
+
+static int
+range_cmp(const void *a, const void *b)
+{
+        const struct range *ra = a, *rb = b;
+        return ra->lo < rb->lo ? -1 : ra->lo > rb->lo;
+}
+
+/* merge sorted ranges a and b into r */
+static void
+range_merge(struct range *r, const struct range *a, size_t na, const struct range *b, size_t nb)
+{
+        size_t i = 0, j = 0, k = 0;
+        while (i < na && j < nb)
+                r[k++] = b[j].lo < a[i].lo ? b[j++] : a[i++];
+        while (i < na)
+                r[k++] = a[i++];
+        while (j < nb)
+                r[k++] = b[j++];
+}
+
+static bool
+range_find(const struct range *r, size_t n, uintptr_t p)
+{
+        size_t lo = 0, hi = n;
+        while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (p < r[mid].lo)
+                        hi = mid;
+                else if (p >= r[mid].hi)
+                        lo = mid + 1;
+                else
+                        return true;
+        }
+        return false;
+}
+
+static void *
+index_alloc(size_t size)
+{
+        void *p = malloc(size);
+        if (!p) {
+                fprintf(stderr, "arena index error: %s", strerror(errno));
+                abort();
+        }
+        return p;
+}
+
+static void
+index_free(struct arena_index *idx)
+{
+        if (idx->owns_main)
+                free(idx->main);
+        free(idx);
+}
+
+static void
+index_free_retired(struct arena_index *idx)
+{
+        for (struct arena_index *r = idx->retired, *next; r; r = next) {
+                next = r->retired;
+                index_free(r);
+        }
+        idx->retired = NULL;
+}
+
+void
+_arena_index_refresh(Arena *arena)
+{
+        _arena_sweep_finish(arena);
+        while (atomic_exchange_explicit(&arena->indexing, true, memory_order_acquire))
+                sched_yield();
+        struct arena_index *old = atomic_load(&arena->index);
+        struct chain *seen_chain = old ? old->chain : NULL;
+        struct slab *seen_slabs = old ? old->slabs : NULL;
+        rb_t added = RB_BLANK;
+        struct chain *chain = atomic_load(&arena->chain);
+        for (struct chain *c = chain; c != seen_chain; c = c->next)
+                RB_PUSH(struct range, &added) = (struct range) {
+                        (uintptr_t)_CHAIN_HEAD(c)->data, (uintptr_t)_head_next(_CHAIN_HEAD(c))
+                };
+        struct slab *slabs = atomic_load(&arena->slabs);
+        for (struct slab *s = slabs; s != seen_slabs; s = s->next)
+                RB_PUSH(struct range, &added) = (struct range) {
+                        (uintptr_t)s->data, (uintptr_t)s->data + s->size
+                };
+        size_t nadded = RB_NITEMS(struct range, &added);
+        if (old && !nadded) {
+                rb_free(&added);
+                goto hold;
+        }
+        if (nadded)
+                qsort(rb_ptr(&added), nadded, sizeof(struct range), range_cmp);
+        size_t nold = old ? old->nrecent : 0, nrecent = nold + nadded;
+        struct index_run *main = old ? old->main : NULL;
+        size_t nmain = main ? main->n : 0;
+        struct arena_index *idx = index_alloc(sizeof(*idx) + nrecent * sizeof(struct range));
+        *idx = (struct arena_index) { .chain = chain, .slabs = slabs, .main = main, .retired = old };
+        range_merge(idx->recent, old ? old->recent : NULL, nold, rb_ptr(&added), nadded);
+        idx->nrecent = nrecent;
+        rb_free(&added);
+        if (!main || (nrecent > 64 && nrecent > nmain / 8)) {
+                idx->main = index_alloc(sizeof(*main) + (nmain + nrecent) * sizeof(struct range));
+                idx->main->n = nmain + nrecent;
+                range_merge(idx->main->r, main ? main->r : NULL, nmain, idx->recent, nrecent);
+                idx->nrecent = 0;
+                if (old)
+                        old->owns_main = true;
+                idx->owns_main = false;
+        }
+        atomic_store(&arena->index, idx);
+        old = idx;
+hold:
+        /* anyone holding an index read it before the swap, anyone holding it
+         * after reads the new one */
+        if (!atomic_load(&arena->index_holders))
+                index_free_retired(old);
+        atomic_store_explicit(&arena->indexing, false, memory_order_release);
+        atomic_fetch_add(&arena->index_holders, 1);
+}
+
+void
+_arena_index_release(Arena *arena)
+{
+        atomic_fetch_sub(&arena->index_holders, 1);
+}
+
+bool
+_arena_index_stale(Arena *arena)
+{
+        struct arena_index *idx = atomic_load(&arena->index);
+        return !idx || idx->chain != atomic_load(&arena->chain) ||
+               idx->slabs != atomic_load(&arena->slabs);
+}
+
+bool
+_arena_index_find(Arena *arena, const void *p)
+{
+        struct arena_index *idx = atomic_load(&arena->index);
+        return idx && (range_find(idx->recent, idx->nrecent, (uintptr_t)p) ||
+                       range_find(idx->main->r, idx->main->n, (uintptr_t)p));
+}
+
+void
+_arena_index_drop(Arena *arena)
+{
+        struct arena_index *idx = atomic_exchange(&arena->index, NULL);
+        if (!idx)
+                return;
+        index_free_retired(idx);
+        idx->owns_main = true;
+        index_free(idx);
+}
+
+bool
+arena_contains(Arena *arena, void *p)
+{
+        _arena_index_refresh(arena);
+        bool found = _arena_index_find(arena, p);
+        _arena_index_release(arena);
+        return found;
 }
 
 void arena_free(Arena *arena)
 {
-        struct chain *orig = atomic_load(&arena->chain);
-        while (!atomic_compare_exchange_weak(&arena->chain, &orig, NULL));
+        _arena_sweep_finish(arena);
+        _arena_index_drop(arena);
+        struct chain *orig = atomic_exchange(&arena->chain, NULL);
         while (orig) {
                 struct chain *nnext = orig->next;
                 free(orig);
                 orig = nnext;
         };
+        atomic_store(&arena->bump, NULL);
+        struct slab *sorig = atomic_exchange(&arena->slabs, NULL);
+        while (sorig) {
+                struct slab *next = sorig->next;
+                free(sorig);
+                sorig = next;
+        }
         assert(!arena->chain);
 }
 
@@ -119,10 +705,17 @@ void *
 arena_finalize_buffer(Arena *bowl, rb_t *buf)
 {
         /* make sure we have some breathing room to keep alignments correct. */
-        int tsz = _ARENA_RUP(rb_len(buf)) * sizeof(void *);
-        rb_calloc(buf, tsz - rb_len(buf));
+        size_t len = rb_len(buf) - sizeof(struct chain);
+        size_t tsz = _ARENA_RUP(len ? len : 1) * sizeof(void *);
+        rb_calloc(buf, tsz - len);
+        if (_head_needs_wide(tsz, 0, 0)) {
+                /* make room for the wide prefix */
+                rb_calloc(buf, sizeof(struct wide));
+                char *p = rb_ptr(buf);
+                memmove(p + sizeof(struct chain) + sizeof(struct wide), p + sizeof(struct chain), tsz);
+        }
         struct chain *chain = rb_take(buf);
-        chain->head.tsz = tsz;
+        struct header *head = _head_init(&chain->head, tsz, 0, 0);
         _arena_add_link(bowl, chain);
-        return chain->data;
+        return head->data;
 }
@@ -8,10 +8,59 @@
 
 struct Arena {
         struct chain *_Atomic chain;
+        struct slab *_Atomic slabs;     // every slab owned by the arena
+        struct slab *_Atomic bump;      // slab currently being carved up
+        size_t slab_size;               // zero to malloc each object on its own
+        struct arena_index *_Atomic index; // address ranges, built on demand
+        struct arena_sweep *_Atomic sweep; // left by arena_vacuums_lazy
+        rb_t *weak_queue;               // weak objects that lost a pointer, if set
+        _Atomic bool sweeping;          // held by whoever is sweeping
+        _Atomic bool indexing;          // held by whoever is refreshing the index
+        _Atomic size_t index_holders;   // threads that may be reading the index
 };
 typedef struct Arena Arena;
 #define ARENA_INIT { .chain = NULL }
 
+/* A slab arena carves objects out of large blocks with a bump pointer rather
+ * than calling malloc for each one, which saves the per object malloc cost and
+ * chain overhead. Objects larger than an eighth of a slab still get their own
+ * block. The individual objects can't be returned to the system so vacuum will
+ * only release a slab once nothing in it is live, freeing the arena is a
+ * handful of calls to free. Objects in slabs are only pointer aligned, see
+ * arena_alloc.
+ *
+ * Arena arena = ARENA_SLAB_INIT;
+ * */
+#define ARENA_SLAB_SIZE (1 << 20)
+#define ARENA_SLAB_INIT { .chain = NULL, .slab_size = ARENA_SLAB_SIZE }
+
+/* A local allocation buffer lets one thread allocate from a shared arena
+ * without touching any shared state. The thread claims a private slab and
+ * bump allocates within it, the slab is only published to the arena when it
+ * fills up or the thread detaches. Large objects still go to the arena
+ * directly.
+ *
+ * An ArenaLocal must only be used by one thread at a time. Objects allocated
+ * through it are valid immediately but are not seen by anything that walks
+ * the arena, such as vacuum or yoinking into the arena, until the slab holding
+ * them is published, so detach before doing either. Detach before freeing the
+ * arena as well.
+ *
+ * ArenaLocal local;
+ * arena_attach(&local, &shared);
+ * ... arena_local_malloc(&local, n) ...
+ * arena_detach(&local);
+ * */
+typedef struct ArenaLocal {
+        Arena *arena;
+        struct slab *slab;
+        char *ptr, *end;
+} ArenaLocal;
+
+void arena_attach(ArenaLocal *local, Arena *arena);
+void arena_detach(ArenaLocal *local);
+void *arena_local_malloc(ArenaLocal *local, size_t n) _MALLOC _MALLOC_SIZE(2);
+
 /* malloc allocates raw bytes without internal structure that will be freed when
  * the arena is freed. */
 void *arena_malloc(Arena *arena, size_t n) _MALLOC _MALLOC_SIZE(2);
@@ -26,6 +75,14 @@ void arena_free(Arena *arena);
  * contains both to and from */
 void arena_join(Arena *to, Arena *from);
 
+/* returns true if p points into memory owned by the arena. This is a range
+ * lookup in an index of the arena's blocks that is built on first use and
+ * afterwards only has to take in blocks added since the previous call, so it is
+ * cheap even for very large arenas, especially slab arenas which have few
+ * blocks. A new index is swapped in whole so lookups never wait, though
+ * threads taking in new blocks at the same time briefly take turns. */
+bool arena_contains(Arena *arena, void *p);
+
 /* utility routines to allocate strings and raw data in an arena. behave like
  * the c standard library routines but allocate return data in the arena */
 char *arena_printf(Arena *arena, char *fmt, ...) _MALLOC _PRINTF(2, 3);
@@ -0,0 +1,126 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define POLY 0x82F63B78         // reflected Castagnoli polynomial
+
+/* the hardware version runs three streams of STRIPE bytes side by side as
+ * the instruction has a latency of three, the crcs are combined by shifting
+ * one over STRIPE zero bytes which shift[] does a byte at a time. */
+#define STRIPE 4096
+
+static uint32_t table[8][256];
+static uint32_t shift[4][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void
+table_init(void)
+{
+        for (int i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                        c = c & 1 ? c >> 1 ^ POLY : c >> 1;
+                table[0][i] = c;
+        }
+        for (int i = 0; i < 256; i++)
+                for (int t = 1; t < 8; t++)
+                        table[t][i] = table[t - 1][i] >> 8 ^ table[0][table[t - 1][i] & 0xFF];
+        /* the shift is linear so it is enough to know it for each bit */
+        uint32_t bit[32];
+        for (int b = 0; b < 32; b++) {
+                uint32_t c = (uint32_t)1 << b;
+                for (int n = 0; n < STRIPE; n++)
+                        c = c >> 8 ^ table[0][c & 0xFF];
+                bit[b] = c;
+        }
+        for (int t = 0; t < 4; t++)
+                for (int i = 0; i < 256; i++) {
+                        uint32_t c = 0;
+                        for (int b = 0; b < 8; b++)
+                                if (i >> b & 1)
+                                        c ^= bit[8 * t + b];
+                        shift[t][i] = c;
+                }
+}
+
+static uint32_t
+crc_shift(uint32_t c)
+{
+        return shift[0][c & 0xFF] ^ shift[1][c >> 8 & 0xFF] ^
+               shift[2][c >> 16 & 0xFF] ^ shift[3][c >> 24];
+}
+
+uint32_t
+crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+        pthread_once(&table_once, table_init);
+        const uint8_t *p = buf;
+        crc = ~crc;
+        for (; len && ((uintptr_t)p & 7); len--)
+                crc = crc >> 8 ^ table[0][(crc ^ *p++) & 0xFF];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        /* eight bytes at a time */
+        for (; len >= 8; len -= 8, p += 8) {
+                uint64_t w;
+                memcpy(&w, p, 8);
+                w ^= crc;
+                crc = table[7][w & 0xFF] ^ table[6][w >> 8 & 0xFF] ^
+                      table[5][w >> 16 & 0xFF] ^ table[4][w >> 24 & 0xFF] ^
+                      table[3][w >> 32 & 0xFF] ^ table[2][w >> 40 & 0xFF] ^
+                      table[1][w >> 48 & 0xFF] ^ table[0][w >> 56];
+        }
+#endif
+        for (; len; len--)
+                crc = crc >> 8 ^ table[0][(crc ^ *p++) & 0xFF];
+        return ~crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+        uint64_t c = ~crc;
+        for (; len && ((uintptr_t)p & 7); len--)
+                c = _mm_crc32_u8(c, *p++);
+        if (len >= 3 * STRIPE)
+                pthread_once(&table_once, table_init);
+        for (; len >= 3 * STRIPE; len -= 3 * STRIPE, p += 3 * STRIPE) {
+                uint64_t c1 = 0, c2 = 0;
+                for (size_t i = 0; i < STRIPE; i += 8) {
+                        uint64_t w0, w1, w2;
+                        memcpy(&w0, p + i, 8);
+                        memcpy(&w1, p + STRIPE + i, 8);
+                        memcpy(&w2, p + 2 * STRIPE + i, 8);
+                        c = _mm_crc32_u64(c, w0);
+                        c1 = _mm_crc32_u64(c1, w1);
+                        c2 = _mm_crc32_u64(c2, w2);
+                }
+                c = crc_shift(crc_shift(c) ^ c1) ^ c2;
+        }
+        for (; len >= 8; len -= 8, p += 8) {
+                uint64_t w;
+                memcpy(&w, p, 8);
+                c = _mm_crc32_u64(c, w);
+        }
+        for (; len; len--)
+                c = _mm_crc32_u8(c, *p++);
+        return ~(uint32_t)c;
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+        if (__builtin_cpu_supports("sse4.2"))
+                return crc32c_hw(crc, buf, len);
+        return crc32c_sw(crc, buf, len);
+}
+#else
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+        return crc32c_sw(crc, buf, len);
+}
+#endif
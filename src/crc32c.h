@@ -0,0 +1,18 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/* CRC-32C (Castagnoli) as used by iSCSI, ext4 and friends. Uses the SSE4.2
+ * crc32 instruction when the cpu has it and a slicing by 8 table otherwise.
+ *
+ * crc is the value returned for the data before buf, 0 to start, so a buffer
+ * can be done in pieces. */
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* the table version, always available for testing against */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+#endif
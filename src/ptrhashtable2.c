@@ -70,8 +70,6 @@ static struct hash_table *alloc_table(int order, int vsize)
 static struct hash_table *
 grow_hash_table(struct hash_table *ht, int vsize)
 {
-        printf("--- %i %i %i\n",
-               ht->count, (ht->size), (ht->size) - ((ht->size - 2)));
         struct hash_table *nht = alloc_table(ht->order + 1, vsize);
         nht->count = ht->count;
         for (int i = 0; i < ht->size; i++) {
@@ -175,7 +173,8 @@ bool ht_in(HashTable *ht, Key k)
 
 void ht_free(HashTable *ht)
 {
-        ifree(ht->ht);
+        if (ht->ht)
+                ifree(ht->ht);
         ht->ht = NULL;
         for (int i = 0; i < _RESERVED_ENTRIES; i++)
                 free(ht->res[i]);
@@ -33,7 +33,7 @@ typedef struct HashTable {
 
 /* vsize should be the number of words that will be in the value field. zero is
  * allowed to make it behave like a set */
-#define HASHTABLE_INIT(vsize) { .vsize = vsize }
+#define HASHTABLE_INIT(n)     { .vsize = (n) }
 #define HASHSET_INIT          { .vsize = 0 }
 #define HASHMAP_INIT          { .vsize = 1 }
 
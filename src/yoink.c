@@ -4,185 +4,680 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include "yoink.h"
+#include "yoink_trace.h"
 #include "inthash.h"
+#include "crc32c.h"
 #include "ptrhashtable2.h"
 #include "resizable_buf.h"
 
-
-
-#define container_of(ptr, type, member) \
-       (type *)( (char *)(ptr) - offsetof(type, member) )
-
 /* we depend on these being the same size */
 _Static_assert(sizeof(void *) == sizeof(uintptr_t));
 
-#define IS_RAW(p)  ((p) == NULL || ((uintptr_t)(p) & 1))
-
 struct header *yoink_header(void *ptr)
 {
         return container_of(ptr, struct header, data);
 }
 
-void *arena_alloc(Arena *arena, int tsz, int bptrs, int eptrs)
+void *arena_alloc(Arena *arena, size_t tsz, size_t bptrs, size_t eptrs)
 {
-        assert((unsigned)bptrs <= UINT8_MAX);
-        assert((unsigned)(eptrs - bptrs) <= UINT16_MAX);
+        assert(bptrs <= eptrs);
         tsz = _ARENA_RUP(tsz) * sizeof(void *); // round up
+        assert(eptrs * sizeof(void *) <= tsz);
 //        printf("arena_alloc(_,%i,%i,%i)\n", tsz, bptrs, eptrs);
-        size_t needed = sizeof(struct chain) + tsz;
-        struct chain *chain = calloc(1, needed);
-        if (!chain) {
-                fprintf(stderr, "arena_alloc error: %s", strerror(errno));
-                abort();
+        return _arena_alloc_header(arena, tsz, eptrs - bptrs, bptrs, true)->data;
+}
+
+void *arena_local_alloc(ArenaLocal *local, size_t tsz, size_t bptrs, size_t eptrs)
+{
+        assert(bptrs <= eptrs);
+        tsz = _ARENA_RUP(tsz) * sizeof(void *); // round up
+        assert(eptrs * sizeof(void *) <= tsz);
+        return _arena_local_header(local, tsz, eptrs - bptrs, bptrs, true)->data;
+}
+
+
+uint32_t
+yoink_set_flags(void *ptr, uint32_t flags)
+{
+        struct header *head = container_of(ptr, struct header, data);
+        uint32_t old = head->flags & _YFLAG_POLICY;
+        head->flags |= flags & _YFLAG_POLICY;
+        head->flags &= ~((flags >> 8) & _YFLAG_POLICY);
+        return old;
+}
+
+/* compacting yoinks are done in two passes, the layout pass traces the graph
+ * deciding where everything goes and the emit pass copies each object
+ * straight to its final place and relocates its pointers. So the output is
+ * written once into memory of exactly the right size. */
+struct layout {
+        HashTable ht;           // object -> offset of its data in the output
+        rb_t objs;              // objects in the order they are laid out
+        size_t len;             // bytes laid out so far
+        bool keep_meta;         // headers are part of the output
+};
+
+#define LAYOUT_INIT(meta, start) { .ht = HASHMAP_INIT, .objs = RB_BLANK, .len = (start), .keep_meta = (meta) }
+
+static void
+layout_free(struct layout *lo)
+{
+        ht_free(&lo->ht);
+        rb_free(&lo->objs);
+}
+
+/* place np unless it has been placed already, the pointers it holds that are
+ * to be copied are pushed on next in order, or reverse order if reverse is
+ * set. */
+static bool
+layout_visit(struct layout *lo, void *np, rb_t *next, bool reverse)
+{
+        uintptr_t *pp = NULL;
+        if (!ht_ins(&lo->ht, (uintptr_t)np, &pp))
+                return false;
+        struct header *head = container_of(np, struct header, data);
+        size_t tsz = _head_tsz(head), nptrs = _head_nptrs(head), bptrs = _head_bptrs(head);
+        /* the wide prefix, if any, is kept with the header */
+        size_t prefix = lo->keep_meta ? (char *)head->data - (char *)_head_start(head) : 0;
+        *pp = lo->len + prefix;
+        lo->len += prefix + tsz;
+        RB_PUSH(struct header *, &lo->objs) = head;
+        if (head->flags & YFLAG_NULL_CHILDREN)
+                return true;
+        for (size_t j = 0; j < nptrs; j++) {
+                void *p = head->data[bptrs + (reverse ? nptrs - 1 - j : j)];
+                if (_yoink_follow(&p))
+                        RB_PUSH(void *, next) = p;
         }
-        chain->head.tsz  = tsz;
-        chain->head.nptrs = eptrs - bptrs;
-        chain->head.bptrs = bptrs;
-        _arena_add_link(arena, chain);
-        return chain->data;
+        return true;
 }
 
+/* bytes of breadth first subtree packed together by YOINK_ORDER_CLUSTERED */
+#define CLUSTER_SIZE 4096
 
-/* trace will contain integers with the offsets to all the pointers in rb, hash
- * table will be filled with a map of pointers to offsets, if keep_meta is true
- * the header will be copied as well. */
+/* lay out everything reachable from root in the given order */
 static void
-_arena_yoink_to_rb(rb_t *target, bool keep_meta, HashTable *ht, rb_t *trace, void *root)
+layout_graph(struct layout *lo, void *root, enum yoink_order order)
 {
-        /* stack is where live objects are kept track of. */
-        rb_t stack = RB_BLANK;
-        for (void *np = root; np; np = RB_MPOP(void *, &stack, NULL)) {
-                uintptr_t *pp = NULL;
-                if (ht_ins(ht, (uintptr_t)np, &pp)) {
-                        int loc = rb_len(target) + (keep_meta ? sizeof(struct header) : 0);
-                        struct header *head = container_of(np, struct header, data);
-                        for (int i = 0; i < head->nptrs; i++) {
-                                if (IS_RAW(head->data[i]))
-                                        continue;
-                                RB_PUSH(void *, &stack) = head->data[i];
-                                RB_PUSH(int, trace) = loc + sizeof(void *)*i;
+        /* stack or queue of objects still to be visited */
+        rb_t todo = RB_BLANK;
+        rb_t cluster = RB_BLANK;
+        size_t qi = 0;
+        switch (order) {
+        case YOINK_ORDER_DFS:
+                for (void *np = root; np; np = RB_MPOP(void *, &todo, NULL))
+                        layout_visit(lo, np, &todo, true);
+                break;
+        case YOINK_ORDER_BFS:
+                RB_PUSH(void *, &todo) = root;
+                while (qi < RB_NITEMS(void *, &todo)) {
+                        void *np = ((void **)rb_ptr(&todo))[qi++];
+                        layout_visit(lo, np, &todo, false);
+                }
+                break;
+        case YOINK_ORDER_CLUSTERED:
+                /* each cluster is a breadth first walk of a subtree that stops
+                 * once it fills CLUSTER_SIZE bytes, whatever it didn't reach
+                 * becomes the root of a later cluster. */
+                RB_PUSH(void *, &todo) = root;
+                while (qi < RB_NITEMS(void *, &todo)) {
+                        void *np = ((void **)rb_ptr(&todo))[qi++];
+                        if (ht_in(&lo->ht, (uintptr_t)np))
+                                continue;
+                        size_t start = lo->len, ci = 0;
+                        rb_clear(&cluster);
+                        RB_PUSH(void *, &cluster) = np;
+                        while (ci < RB_NITEMS(void *, &cluster) && lo->len - start < CLUSTER_SIZE) {
+                                np = ((void **)rb_ptr(&cluster))[ci++];
+                                layout_visit(lo, np, &cluster, false);
                         }
-                        *pp = loc;
-                        if (keep_meta) {
-                                rb_append(target, head, sizeof(*head) + head->tsz);
-                        } else {
-                                rb_append(target, head->data, head->tsz);
+                        for (; ci < RB_NITEMS(void *, &cluster); ci++)
+                                RB_PUSH(void *, &todo) = ((void **)rb_ptr(&cluster))[ci];
+                }
+                break;
+        }
+        rb_free(&todo);
+        rb_free(&cluster);
+}
+
+/* copy the laid out objects to out, pointers are relocated to out. */
+static void
+layout_emit(struct layout *lo, char *out, uint64_t *relocs)
+{
+        RB_FOR(struct header *, ph, &lo->objs) {
+                struct header *head = *ph;
+                size_t tsz = _head_tsz(head), nptrs = _head_nptrs(head), bptrs = _head_bptrs(head);
+                char *data = out + *ht_get(&lo->ht, (uintptr_t)head->data);
+                if (lo->keep_meta) {
+                        char *start = _head_start(head);
+                        memcpy(data - ((char *)head->data - start), start, (char *)head->data - start + tsz);
+                } else
+                        memcpy(data, head->data, tsz);
+                /* policies are applied to the copy */
+                void **ptrs = (void **)data + bptrs;
+                if (head->flags & YFLAG_NULL_CHILDREN) {
+                        memset(ptrs, 0, nptrs * sizeof(void *));
+                        continue;
+                }
+                for (size_t i = 0; i < nptrs; i++) {
+                        if (!_yoink_follow(&ptrs[i]))
+                                continue;
+                        ptrs[i] = out + *ht_get(&lo->ht, (uintptr_t)ptrs[i]);
+                        if (relocs) {
+                                size_t w = (void **)&ptrs[i] - (void **)out;
+                                relocs[w / 64] |= (uint64_t)1 << w % 64;
                         }
                 }
         }
-        rb_free(&stack);
 }
 
 void *
 yoink_to_malloc(void *root, size_t *len)
+{
+        return yoink_to_malloc_ordered(root, len, YOINK_ORDER_DFS);
+}
+
+void *
+yoink_to_malloc_ordered(void *root, size_t *len, enum yoink_order order)
 {
         if (len)
                 *len = 0;
         if (IS_RAW(root))
                 return NULL;
-        rb_t trace = RB_BLANK;
-        rb_t output = RB_BLANK;
-        HashTable ht = HASHMAP_INIT;
-        _arena_yoink_to_rb(&output, false, &ht, &trace, root);
-        void *ptr = rb_ptr(&output);
-        RB_FOR(int, tp, &trace) {
-                int loc = *tp;
-                void **data = ptr + loc;
-                void *odata = *data;
-                Value *v = ht_get(&ht, (uintptr_t) * data);
-                *data = ptr + *v;
-                printf("radjusting@%i via %lu %p -> %p\n", loc, *v, odata, *data);
-                assert(*data >= rb_ptr(&output));
-                assert(*data < rb_endptr(&output));
-        }
-        //ht_dump(&ht);
-        printf("trace: %li\n", (long)RB_NITEMS(int, &trace));
-        rb_free(&trace);
-        ht_free(&ht);
-        if (len)
-                *len = rb_len(&output);
-        return rb_take(&output);
+        struct layout lo = LAYOUT_INIT(false, 0);
+        layout_graph(&lo, root, order);
+        char *out = malloc(lo.len);
+        if (out) {
+                layout_emit(&lo, out, NULL);
+                if (len)
+                        *len = lo.len;
+        }
+        layout_free(&lo);
+        return out;
 }
 
+size_t
+yoink_size(void *root)
+{
+        if (IS_RAW(root))
+                return 0;
+        struct layout lo = LAYOUT_INIT(false, 0);
+        layout_graph(&lo, root, YOINK_ORDER_DFS);
+        layout_free(&lo);
+        return lo.len;
+}
+
+void *
+yoink_to_buffer(void *root, void *buf, size_t len)
+{
+        if (IS_RAW(root))
+                return NULL;
+        struct layout lo = LAYOUT_INIT(false, 0);
+        layout_graph(&lo, root, YOINK_ORDER_DFS);
+        if (lo.len <= len)
+                layout_emit(&lo, buf, NULL);
+        layout_free(&lo);
+        return lo.len <= len ? buf : NULL;
+}
+
+
+/* once tracing is done, replace each pointer of the weak objects by what
+ * resolve says becomes of it, queueing the objects that had one cleared. */
+void
+_yoink_weak_fixup(Arena *arena, rb_t *weak, void *(*resolve)(void *arg, void *p), void *arg)
+{
+        RB_FOR(struct header *, ph, weak) {
+                struct header *head = *ph;
+                void **ptrs = head->data + _head_bptrs(head);
+                bool lost = false;
+                for (size_t i = 0; i < _head_nptrs(head); i++) {
+                        if (IS_RAW(ptrs[i]))
+                                continue;
+                        ptrs[i] = resolve(arg, ptrs[i]);
+                        lost |= !ptrs[i];
+                }
+                if (lost && arena->weak_queue)
+                        RB_PUSH(void *, arena->weak_queue) = head->data;
+        }
+}
+
+void *
+_yoink_resolve(void *arg, void *p)
+{
+        struct _yoink_weak *yw = arg;
+        void *q = p;
+        if (!_yoink_follow(&q) || _arena_index_find(yw->to, p))
+                return q;
+        Value *v = ht_get(yw->ht, (uintptr_t)p);
+        return v ? (void *)*v : NULL;
+}
 
 ssize_t
 yoinks_to_arena(Arena *to, int nroots, void *root[nroots])
 {
         ssize_t tlen = 0;
-        rb_t stack = RB_BLANK;
+        rb_t stack = RB_BLANK, weak = RB_BLANK;
         HashTable ht = HASHMAP_INIT;
-        /* initialize with everything already in to so it isn't copied */
-        for (struct chain *c = to->chain; c; c = c->next)
-                * ht_set(&ht, (intptr_t)c->data)  = (intptr_t)c->data;
+        /* anything already in to is left in place rather than copied, the
+         * index is not refreshed again so our own copies are never looked up
+         * in it. */
+        _arena_index_refresh(to);
         /* push roots onto stack */
         for (int i = 0; i < nroots; i++)
                 RB_PUSH(void **, &stack) = root + i;
         RB_FOR_ENUM(void **, pnp, &stack) {
                 void **np = *pnp.v;
-                if (!*np || ((uintptr_t)*np & 1))
+                if (!_yoink_follow(np) || _arena_index_find(to, *np))
                         continue;
                 uintptr_t *pp = NULL;
                 if (ht_ins(&ht, (uintptr_t)*np, &pp)) {
                         struct header *head = container_of(*np, struct header, data);
-                        struct chain *chain = malloc(sizeof(struct chain) + head->tsz);
-                        chain->head = *head;
-                        memcpy(chain->data, head->data, head->tsz);
-                        _arena_add_link(to, chain);
-                        tlen += chain->head.tsz;
-                        for (int i = 0; i < chain->head.nptrs; i++)
-                                RB_PUSH(void **, &stack) = &chain->data[i];
-                        *pp = (uintptr_t)chain->data;
+                        struct header *nhead = _arena_clone_header(to, head);
+                        size_t tsz = _head_tsz(head), nptrs = _head_nptrs(head);
+                        memcpy(nhead->data, head->data, tsz);
+                        tlen += tsz;
+                        if (_yoink_null_children(nhead))
+                                ;
+                        else if (nhead->flags & YFLAG_WEAK)
+                                RB_PUSH(struct header *, &weak) = nhead;
+                        else
+                                for (size_t i = 0; i < nptrs; i++)
+                                        RB_PUSH(void **, &stack) = &nhead->data[_head_bptrs(nhead) + i];
+                        *pp = (uintptr_t)nhead->data;
                         assert(*pp);
                 }
                 *np = (void *)*pp;
         }
+        _yoink_weak_fixup(to, &weak, _yoink_resolve, &(struct _yoink_weak) { to, &ht });
+        _arena_index_release(to);
+        rb_free(&weak);
         rb_free(&stack);
         ht_free(&ht);
         return tlen;
 }
 
+/* state for a destructive Cheney style yoink. copies are carved from a local
+ * buffer so they sit one after another and the slabs they were carved from,
+ * in order, act as the queue of objects left to scan. objects too large for
+ * the buffer are queued on large.
+ *
+ * when compacting only objects in from are moved, anything outside it is
+ * traced in place once, remembered in foreign, and queued on large, unless it
+ * is in keep which is left alone altogether. */
+struct cheney {
+        Arena *to;
+        Arena *from;
+        Arena *keep;
+        ArenaLocal local;
+        rb_t slabs;
+        rb_t large;
+        rb_t weak;
+        HashTable foreign;
+        ssize_t tlen;
+};
+
+/* compaction keeps whatever vacuum would, aliased objects included */
+static bool
+cheney_follow(struct cheney *ch, void **pp)
+{
+        if (!ch->from)
+                return _yoink_follow(pp);
+        void *p = *pp;
+        if (IS_RAW(p))
+                return false;
+        if (yoink_header(p)->flags & YFLAG_NULL_SELF) {
+                *pp = NULL;
+                return false;
+        }
+        return true;
+}
+
+static void *
+cheney_forward(struct cheney *ch, void *p)
+{
+        if (ch->from && !_arena_index_find(ch->from, p)) {
+                if (ch->keep && _arena_index_find(ch->keep, p))
+                        return p;
+                if (ht_add(&ch->foreign, (uintptr_t)p)) {
+                        struct header *head = container_of(p, struct header, data);
+                        if (!_yoink_null_children(head))
+                                RB_PUSH(struct header *, &ch->large) = head;
+                }
+                return p;
+        }
+        if (!ch->from && _arena_index_find(ch->to, p))
+                return p;
+        struct header *head = container_of(p, struct header, data);
+        if (head->flags & YFLAG_FORWARDED)
+                return head->data[0];
+        size_t tsz = _head_tsz(head);
+        assert(tsz >= sizeof(void *));
+        struct slab *last = ch->local.slab;
+        struct header *nhead = _arena_local_clone_header(&ch->local, head);
+        memcpy(nhead->data, head->data, tsz);
+        _yoink_null_children(nhead);
+        ch->tlen += tsz;
+        if (ch->local.slab != last)
+                RB_PUSH(struct slab *, &ch->slabs) = ch->local.slab;
+        if (!ch->local.slab || (char *)nhead < (char *)ch->local.slab->data ||
+            (char *)nhead >= ch->local.end)
+                RB_PUSH(struct header *, &ch->large) = nhead;
+        head->flags |= YFLAG_FORWARDED;
+        head->data[0] = nhead->data;
+        return nhead->data;
+}
+
+static void
+cheney_scan(struct cheney *ch, struct header *head)
+{
+        if (head->flags & YFLAG_WEAK) {
+                RB_PUSH(struct header *, &ch->weak) = head;
+                return;
+        }
+        void **ptrs = head->data + _head_bptrs(head);
+        size_t nptrs = _head_nptrs(head);
+        for (size_t i = 0; i < nptrs; i++)
+                if (cheney_follow(ch, &ptrs[i]))
+                        ptrs[i] = cheney_forward(ch, ptrs[i]);
+}
+
+/* weak pointers follow what was moved and lose what was left behind, except
+ * for objects outside the arena being compacted which nothing frees */
+static void *
+cheney_resolve(void *arg, void *p)
+{
+        struct cheney *ch = arg;
+        void *q = p;
+        if (!cheney_follow(ch, &q))
+                return q;
+        struct header *head = yoink_header(p);
+        if (head->flags & YFLAG_FORWARDED)
+                return head->data[0];
+        if (ch->from ? !_arena_index_find(ch->from, p) : _arena_index_find(ch->to, p))
+                return p;
+        return NULL;
+}
+
+/* forward the roots and scan until nothing is left to scan */
+static void
+cheney_run(struct cheney *ch, int nroots, void *root[nroots])
+{
+        arena_attach(&ch->local, ch->to);
+        for (int i = 0; i < nroots; i++)
+                if (cheney_follow(ch, &root[i]))
+                        root[i] = cheney_forward(ch, root[i]);
+        size_t nslab = 0;
+        char *scan = NULL;
+        for (;;) {
+                if (nslab < RB_NITEMS(struct slab *, &ch->slabs)) {
+                        struct slab *s = ((struct slab **)rb_ptr(&ch->slabs))[nslab];
+                        if (!scan)
+                                scan = (char *)s->data;
+                        /* the slab being filled ends at the local bump pointer */
+                        char *end = s == ch->local.slab ? ch->local.ptr : _slab_end(s);
+                        if (scan < end) {
+                                struct header *head = _head_at(scan);
+                                scan = _head_next(head);
+                                cheney_scan(ch, head);
+                                continue;
+                        }
+                        if (s != ch->local.slab) {
+                                nslab++;
+                                scan = NULL;
+                                continue;
+                        }
+                }
+                struct header *head = RB_MPOP(struct header *, &ch->large, NULL);
+                if (!head)
+                        break;
+                cheney_scan(ch, head);
+        }
+        _yoink_weak_fixup(ch->to, &ch->weak, cheney_resolve, ch);
+        arena_detach(&ch->local);
+        rb_free(&ch->slabs);
+        rb_free(&ch->large);
+        rb_free(&ch->weak);
+}
+
 ssize_t
-arena_vacuums(Arena *bowl, int nroots, void *root[nroots])
+yoinks_to_arena_destructive(Arena *to, int nroots, void *root[nroots])
+{
+        struct cheney ch = { .to = to, .slabs = RB_BLANK, .large = RB_BLANK, .weak = RB_BLANK };
+        _arena_index_refresh(to);
+        cheney_run(&ch, nroots, root);
+        _arena_index_release(to);
+        return ch.tlen;
+}
+
+ssize_t
+_yoinks_to_arena_from(Arena *to, Arena *from, Arena *keep, int nroots, void *root[nroots])
+{
+        struct cheney ch = {
+                .to = to, .from = from, .keep = keep, .slabs = RB_BLANK, .large = RB_BLANK,
+                .weak = RB_BLANK, .foreign = HASHSET_INIT
+        };
+        _arena_index_refresh(from);
+        _arena_index_refresh(keep);
+        cheney_run(&ch, nroots, root);
+        _arena_index_release(keep);
+        _arena_index_release(from);
+        ht_free(&ch.foreign);
+        return ch.tlen;
+}
+
+/* the blocks of the arena are taken away and whatever is reachable in them
+ * is copied back into fresh slabs in the order it is reached, the old blocks
+ * are then freed whole. */
+ssize_t
+arena_compacts(Arena *bowl, int nroots, void *root[nroots], struct arena_compact_stats *stats)
+{
+        Arena old = ARENA_INIT;
+        arena_join(&old, bowl);
+        _arena_index_refresh(&old);
+        struct cheney ch = {
+                .to = bowl, .from = &old, .slabs = RB_BLANK, .large = RB_BLANK, .weak = RB_BLANK,
+                .foreign = HASHSET_INIT
+        };
+        cheney_run(&ch, nroots, root);
+        _arena_index_release(&old);
+        ht_free(&ch.foreign);
+        struct arena_compact_stats st = { .moved = ch.tlen };
+        size_t total = 0;
+        for (struct chain *c = old.chain; c; c = c->next, st.blocks++)
+                total += _head_tsz(_CHAIN_HEAD(c));
+        for (struct slab *s = old.slabs; s; s = s->next, st.blocks++)
+                _SLAB_FOR(h, s)
+                        total += _head_tsz(h);
+        arena_free(&old);
+        st.freed = total - st.moved;
+        if (stats)
+                *stats = st;
+        return st.freed;
+}
+
+/* mark everything reachable from the roots with YFLAG_IS_USED. objects outside
+ * the arena are reached and marked too, so every object marked is recorded
+ * for its mark to be cleared if the sweep doesn't get to it. A lazy sweep
+ * keeps the marks itself. */
+static void
+vacuum_mark(int nroots, void *root[nroots], rb_t *marked, struct arena_sweep *sw, rb_t *weak)
 {
         rb_t stack = RB_BLANK;
-        HashTable ht = HASHSET_INIT;
-        /* if we don't want to copy we have to seed the table with pointers
-         * already in target */
         for (int i = 0; i < nroots; i++)
-                RB_PUSH(void *, &stack) = root[i];
-        RB_FOR_ENUM(void *, pnp, &stack) {
-                void *np = *pnp.v;
-                if (!np || ((uintptr_t)np & 1))
+                RB_PUSH(void **, &stack) = &root[i];
+        void **np;
+        while ((np = RB_MPOP(void **, &stack, NULL))) {
+                if (IS_RAW(*np))
+                        continue;
+                /* aliasing means nothing here as nothing is copied */
+                struct header *head = container_of(*np, struct header, data);
+                if (head->flags & YFLAG_NULL_SELF) {
+                        *np = NULL;
                         continue;
-                if (ht_add(&ht, (uintptr_t)np)) {
-                        struct chain *chain = container_of(np, struct chain, data);
-                        for (int i = 0; i < chain->head.nptrs; i++)
-                                RB_PUSH(void *, &stack) = chain->data[i];
                 }
+                if (sw) {
+                        if (!_arena_sweep_mark(sw, head))
+                                continue;
+                } else {
+                        if (head->flags & YFLAG_IS_USED)
+                                continue;
+                        head->flags |= YFLAG_IS_USED;
+                        RB_PUSH(struct header *, marked) = head;
+                }
+                if (_yoink_null_children(head))
+                        continue;
+                if (head->flags & YFLAG_WEAK)
+                        RB_PUSH(struct header *, weak) = head;
+                else
+                        for (size_t i = _head_nptrs(head); i--;)
+                                RB_PUSH(void **, &stack) = &head->data[_head_bptrs(head) + i];
         }
         rb_free(&stack);
+}
+
+/* unmarked objects of the arena are told from ones outside it by a set of its
+ * chains and its slabs sorted by address, made the first time it is needed */
+struct vacuum_weak {
+        Arena *bowl;
+        HashTable chains;
+        rb_t slabs;
+        bool made;
+};
+
+static int
+slab_cmp(const void *a, const void *b)
+{
+        uintptr_t x = (uintptr_t)*(struct slab **)a, y = (uintptr_t)*(struct slab **)b;
+        return x < y ? -1 : x > y;
+}
+
+static bool
+vacuum_owns(struct vacuum_weak *vw, struct header *head)
+{
+        if (!vw->made) {
+                vw->chains = (HashTable)HASHSET_INIT;
+                vw->slabs = (rb_t)RB_BLANK;
+                for (struct chain *c = vw->bowl->chain; c; c = c->next)
+                        ht_add(&vw->chains, (uintptr_t)_CHAIN_HEAD(c));
+                for (struct slab *s = vw->bowl->slabs; s; s = s->next)
+                        RB_PUSH(struct slab *, &vw->slabs) = s;
+                if (RB_NITEMS(struct slab *, &vw->slabs) > 1)
+                        qsort(rb_ptr(&vw->slabs), RB_NITEMS(struct slab *, &vw->slabs),
+                              sizeof(struct slab *), slab_cmp);
+                vw->made = true;
+        }
+        if (ht_in(&vw->chains, (uintptr_t)head))
+                return true;
+        struct slab **sl = rb_ptr(&vw->slabs);
+        size_t lo = 0, hi = RB_NITEMS(struct slab *, &vw->slabs);
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if ((uintptr_t)sl[mid]->data <= (uintptr_t)head)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo && (uintptr_t)head - (uintptr_t)sl[lo - 1]->data < sl[lo - 1]->size;
+}
+
+/* weak pointers to what is about to be freed are cleared, only objects in
+ * the arena are ever freed */
+static void *
+vacuum_resolve(void *arg, void *p)
+{
+        struct header *head = yoink_header(p);
+        if (head->flags & YFLAG_NULL_SELF)
+                return NULL;
+        return head->flags & YFLAG_IS_USED || !vacuum_owns(arg, head) ? p : NULL;
+}
+
+static void *
+vacuum_resolve_lazy(void *arg, void *p)
+{
+        struct header *head = yoink_header(p);
+        if (head->flags & YFLAG_NULL_SELF)
+                return NULL;
+        return _arena_sweep_dead(arg, head) ? NULL : p;
+}
+
+ssize_t
+arena_vacuums(Arena *bowl, int nroots, void *root[nroots])
+{
+        ssize_t swept = _arena_sweep_finish(bowl);
+        rb_t marked = RB_BLANK, weak = RB_BLANK;
+        vacuum_mark(nroots, root, &marked, NULL, &weak);
+        struct vacuum_weak vw = { .bowl = bowl };
+        _yoink_weak_fixup(bowl, &weak, vacuum_resolve, &vw);
+        rb_free(&weak);
+        if (vw.made) {
+                ht_free(&vw.chains);
+                rb_free(&vw.slabs);
+        }
+        _arena_index_drop(bowl);
+        /* the sweep clears the marks of what it keeps */
+        size_t kept = 0;
         struct chain *chain = bowl->chain;
         struct chain **pch = &chain;
         ssize_t freed  = 0;
         while (*pch) {
                 struct chain *next = pch[0]->next;
-                if (!ht_in(&ht, (uintptr_t)pch[0]->data)) {
-                        freed += pch[0]->head.tsz;
-//                        printf("dfree: %p\n", pch[0]->data);
-//                       printf("free: %p\n", pch[0]);
+                struct header *head = _CHAIN_HEAD(pch[0]);
+                if (!(head->flags & YFLAG_IS_USED)) {
+                        freed += _head_tsz(head);
                         free(pch[0]);
                         *pch = next;
                 } else {
-                        //                      printf("dkeep: %p\n", pch[0]->data);
-                        //                     printf("keep: %p\n", pch[0]);
+                        head->flags &= ~YFLAG_IS_USED;
+                        kept++;
                         pch = &pch[0]->next;
                 }
         }
+        /* slabs can only be released once nothing in them is live, the slab
+         * being bumped is always kept. */
+        struct slab **psl = (struct slab **)&bowl->slabs;
+        while (*psl) {
+                struct slab *s = *psl;
+                ssize_t sfreed = 0;
+                bool live = s == bowl->bump;
+                _SLAB_FOR(h, s) {
+                        if (h->flags & YFLAG_IS_USED) {
+                                h->flags &= ~YFLAG_IS_USED;
+                                live = true;
+                                kept++;
+                        } else
+                                sfreed += _head_tsz(h);
+                }
+                if (live) {
+                        psl = &s->next;
+                } else {
+                        freed += sfreed;
+                        *psl = s->next;
+                        free(s);
+                }
+        }
         bowl->chain = chain;
-        //    ht_dump(&ht);
-        ht_free(&ht);
-        return freed;
+        /* something marked wasn't in the arena */
+        if (kept < RB_NITEMS(struct header *, &marked))
+                RB_FOR(struct header *, h, &marked)
+                        (*h)->flags &= ~YFLAG_IS_USED;
+        rb_free(&marked);
+        return swept + freed;
+}
+
+void
+arena_vacuums_lazy(Arena *bowl, int nroots, void *root[nroots])
+{
+        _arena_sweep_finish(bowl);
+        struct arena_sweep *sw = _arena_sweep_begin(bowl);
+        rb_t weak = RB_BLANK;
+        vacuum_mark(nroots, root, NULL, sw, &weak);
+        _yoink_weak_fixup(bowl, &weak, vacuum_resolve_lazy, sw);
+        rb_free(&weak);
+        _arena_sweep_start(bowl, sw);
 }
 
 
@@ -194,8 +689,7 @@ void *yoink_to_arena(Arena *to, void *root)
 
 /* very basic signature, this isn't cryptographically secure or anything, it is
  * just to catch gross errors early */
-static
-uintptr_t mk_signature(void)
+uintptr_t _yoink_signature(void)
 {
         static uintptr_t signature = 0;
         if (!signature) {
@@ -213,55 +707,548 @@ uintptr_t mk_signature(void)
         return signature;
 }
 
+size_t
+yoink_frozen_size(void *root)
+{
+        if (IS_RAW(root))
+                return sizeof(struct frozen);
+        struct layout lo = LAYOUT_INIT(true, sizeof(struct frozen));
+        layout_graph(&lo, root, YOINK_ORDER_DFS);
+        layout_free(&lo);
+        return lo.len + _relocs_size(lo.len);
+}
+
 struct frozen *yoink_freeze(void *root, struct frozen *ice)
 {
-        rb_t to = RB_BLANK;
-        struct frozen *fz = rb_calloc(&to, sizeof(struct frozen));
-        fz->magic = mk_signature();
-        if (IS_RAW(root)) {
-                fz->length = rb_len(&to);
-                fz->base = fz;
-                fz->root = root;
-                return rb_take(&to);
+        return yoink_freeze_flags(root, ice, YOINK_FROZEN_CRC);
+}
+
+struct frozen *
+yoink_freeze_flags(void *root, struct frozen *ice, int flags)
+{
+        struct layout lo = LAYOUT_INIT(true, sizeof(struct frozen));
+        if (!IS_RAW(root))
+                layout_graph(&lo, root, YOINK_ORDER_DFS);
+        size_t len = IS_RAW(root) ? lo.len : lo.len + _relocs_size(lo.len);
+        struct frozen *fz = ice ? ice : malloc(len);
+        if (!fz || (ice && ice->length < len)) {
+                layout_free(&lo);
+                return NULL;
         }
-        HashTable ht = HASHMAP_INIT;
-        rb_t trace = RB_BLANK;
-        _arena_yoink_to_rb(&to, true, &ht, &trace, root);
-        void *ptr = rb_ptr(&to);
-        RB_FOR(int, tp, &trace) {
-                int loc = *tp;
-                void **data = ptr + loc;
-                void *odata = *data;
-                Value *v = ht_get(&ht, (uintptr_t) * data);
-                *data = ptr + *v;
-                printf("radjusting@%i via %lu %p -> %p\n", loc, *v, odata, *data);
-                assert(*data >= rb_ptr(&to));
-                assert(*data < rb_endptr(&to));
-        }
-        fz = rb_ptr(&to);
-        fz->root = (void *)*ht_get(&ht, (uintptr_t)root);
-        fz->length = rb_len(&to);
+        fz->magic = _yoink_signature();
+        fz->length = len;
         fz->base = fz;
-        return rb_take(&to);
+        fz->root = root;
+        fz->relocs = 0;
+        if (!IS_RAW(root)) {
+                fz->relocs = lo.len;
+                uint64_t *relocs = (uint64_t *)((char *)fz + lo.len);
+                memset(relocs, 0, len - lo.len);
+                layout_emit(&lo, (char *)fz, relocs);
+                fz->root = (char *)fz + *ht_get(&lo.ht, (uintptr_t)root);
+        }
+        fz->flags = flags & YOINK_FROZEN_CRC;
+        fz->crc = 0;
+        if (fz->flags)
+                fz->crc = yoink_frozen_crc(fz);
+        layout_free(&lo);
+        return fz;
+}
+
+uint32_t
+yoink_frozen_crc(struct frozen *ice)
+{
+        struct frozen head = *ice;
+        head.crc = 0;
+        uint32_t crc = crc32c(0, &head, sizeof(head));
+        return crc32c(crc, ice->data, ice->length - sizeof(head));
+}
+
+/* check the headers and pointer fields of an untrusted image, and that the
+ * relocation bitmap marks exactly the pointers into it. */
+static bool
+thaw_bounds_ok(struct frozen *ice)
+{
+        uintptr_t lo = (uintptr_t)ice->base;
+        size_t objs = ice->relocs ? ice->relocs : ice->length;
+        const uint64_t *bits = NULL;
+        if (ice->relocs) {
+                if (objs % sizeof(void *) || objs < sizeof(struct frozen) || objs > ice->length ||
+                    ice->length - objs != _relocs_size(objs))
+                        return false;
+                bits = (uint64_t *)((char *)ice + objs);
+        }
+        size_t marked = 0;
+        char *p = (char *)ice->data, *end = (char *)ice + objs;
+        while (p < end) {
+                if ((size_t)(end - p) < sizeof(struct header) ||
+                    (((struct header *)p)->tsz == _YOINK_WIDE &&
+                     (size_t)(end - p) < sizeof(struct wide) + sizeof(struct header)))
+                        return false;
+                struct header *head = _head_at(p);
+                size_t tsz = _head_tsz(head), bptrs = _head_bptrs(head), nptrs = _head_nptrs(head);
+                if (tsz % sizeof(void *) || tsz > (size_t)(end - (char *)head->data) ||
+                    bptrs > tsz / sizeof(void *) || nptrs > tsz / sizeof(void *) - bptrs)
+                        return false;
+                void **ptrs = head->data + bptrs;
+                for (size_t i = 0; i < nptrs; i++) {
+                        uintptr_t v = (uintptr_t)ptrs[i];
+                        if (!v || (v & 1))
+                                continue;
+                        if (v - lo < sizeof(struct frozen) || v - lo >= objs)
+                                return false;
+                        if (bits) {
+                                size_t w = (void **)&ptrs[i] - (void **)ice;
+                                if (!(bits[w / 64] >> w % 64 & 1))
+                                        return false;
+                                marked++;
+                        }
+                }
+                p = (char *)head->data + tsz;
+        }
+        if (bits) {
+                for (size_t i = 0; i < (ice->length - objs) / sizeof(uint64_t); i++)
+                        marked -= __builtin_popcountll(bits[i]);
+                if (marked)
+                        return false;
+        }
+        uintptr_t r = (uintptr_t)ice->root;
+        return !r || (r & 1) || (r - lo >= sizeof(struct frozen) && r - lo < objs);
+}
+
+void *
+yoink_thaw_checked(struct frozen *ice, size_t len, int flags)
+{
+        if (len < sizeof(struct frozen) || ice->magic != _yoink_signature() ||
+            ice->length < sizeof(struct frozen) || ice->length > len)
+                return NULL;
+        if ((flags & YOINK_THAW_CRC) &&
+            (!(ice->flags & YOINK_FROZEN_CRC) || ice->crc != yoink_frozen_crc(ice)))
+                return NULL;
+        if ((flags & YOINK_THAW_BOUNDS) && !thaw_bounds_ok(ice))
+                return NULL;
+        return yoink_thaw(ice);
+}
+
+/* relocate the objects from p on that lie entirely before end, returns where
+ * it stopped. only pointers into the image move, NULL, tagged and aliased
+ * pointers stay as they are. headers aren't trusted, an object that isn't a
+ * whole number of words, has more pointers than words or runs past limit, the
+ * end of the objects, makes it return NULL. */
+static char *
+thaw_objects(char *p, char *end, char *limit, uintptr_t lo, uintptr_t len, ptrdiff_t offset)
+{
+        while (p + sizeof(struct header) <= end) {
+                if (((struct header *)p)->tsz == _YOINK_WIDE &&
+                    p + sizeof(struct wide) + sizeof(struct header) > end)
+                        break;
+                struct header *head = _head_at(p);
+                size_t tsz = _head_tsz(head), bptrs = _head_bptrs(head), nptrs = _head_nptrs(head);
+                if (tsz % sizeof(void *) || tsz > (size_t)(limit - (char *)head->data) ||
+                    bptrs > tsz / sizeof(void *) || nptrs > tsz / sizeof(void *) - bptrs)
+                        return NULL;
+                if (tsz > (size_t)(end - (char *)head->data))
+                        break;
+                void **ptrs = head->data + bptrs;
+                for (size_t i = 0; i < nptrs; i++)
+                        if (!((uintptr_t)ptrs[i] & 1) && (uintptr_t)ptrs[i] - lo < len)
+                                ptrs[i] = (char *)ptrs[i] + offset;
+                p = (char *)head->data + tsz;
+        }
+        return p;
+}
+
+/* rebasing words by the relocation bitmap, every word whose bit is set gets
+ * offset added. Blocks of 64 words with no pointers are skipped and full ones
+ * added to straight, the rest go a few words at a time with the offset masked
+ * down to the lanes whose bit is set. */
+static void
+rebase_scalar(uintptr_t *w, const uint64_t *bits, size_t nwords, uintptr_t offset)
+{
+        for (size_t i = 0; i < nwords; i += 64) {
+                for (uint64_t m = bits[i / 64]; m; m &= m - 1)
+                        w[i + __builtin_ctzll(m)] += offset;
+        }
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+
+/* lane masks for each nibble of the bitmap, two or four words at a time */
+static const int64_t rebase_lanes[16][4] __attribute__((aligned(32))) = {
+#define L(n) { -((n) & 1), -((n) >> 1 & 1), -((n) >> 2 & 1), -((n) >> 3 & 1) }
+        L(0), L(1), L(2), L(3), L(4), L(5), L(6), L(7),
+        L(8), L(9), L(10), L(11), L(12), L(13), L(14), L(15),
+#undef L
+};
+
+static void
+rebase_sse2(uintptr_t *w, const uint64_t *bits, size_t nwords, uintptr_t offset)
+{
+        __m128i off = _mm_set1_epi64x(offset);
+        size_t i;
+        for (i = 0; i + 64 <= nwords; i += 64) {
+                uint64_t m = bits[i / 64];
+                if (!m)
+                        continue;
+                __m128i *v = (__m128i *)&w[i];
+                for (int j = 0; j < 32; j++, m >>= 2) {
+                        __m128i add = _mm_and_si128(_mm_load_si128((__m128i *)rebase_lanes[m & 3]), off);
+                        _mm_storeu_si128(&v[j], _mm_add_epi64(_mm_loadu_si128(&v[j]), add));
+                }
+        }
+        /* vectors could run off the end of a short last block */
+        rebase_scalar(w + i, bits + i / 64, nwords - i, offset);
+}
+
+__attribute__((target("avx2"))) static void
+rebase_avx2(uintptr_t *w, const uint64_t *bits, size_t nwords, uintptr_t offset)
+{
+        __m256i off = _mm256_set1_epi64x(offset);
+        size_t i;
+        for (i = 0; i + 64 <= nwords; i += 64) {
+                uint64_t m = bits[i / 64];
+                if (!m)
+                        continue;
+                __m256i *v = (__m256i *)&w[i];
+                for (int j = 0; j < 16; j++, m >>= 4) {
+                        __m256i add = _mm256_and_si256(_mm256_load_si256((__m256i *)rebase_lanes[m & 15]), off);
+                        _mm256_storeu_si256(&v[j], _mm256_add_epi64(_mm256_loadu_si256(&v[j]), add));
+                }
+        }
+        rebase_scalar(w + i, bits + i / 64, nwords - i, offset);
+}
+
+void
+_yoink_rebase(uintptr_t *w, const uint64_t *bits, size_t nwords, uintptr_t offset)
+{
+        if (__builtin_cpu_supports("avx2"))
+                rebase_avx2(w, bits, nwords, offset);
+        else
+                rebase_sse2(w, bits, nwords, offset);
+}
+#else
+void
+_yoink_rebase(uintptr_t *w, const uint64_t *bits, size_t nwords, uintptr_t offset)
+{
+        rebase_scalar(w, bits, nwords, offset);
+}
+#endif
+
+/* the last step of thawing once all objects have been relocated */
+void *
+_yoink_thaw_finish(struct frozen *ice)
+{
+        uintptr_t lo = (uintptr_t)ice->base;
+        if (!((uintptr_t)ice->root & 1) && (uintptr_t)ice->root - lo < ice->length)
+                ice->root = (char *)ice + ((char *)ice->root - (char *)ice->base);
+        /* the checksum was of the image as frozen */
+        if (ice->base != ice)
+                ice->flags &= ~YOINK_FROZEN_CRC;
+        ice->base = ice;
+        return ice->root;
 }
 
 void *yoink_thaw(struct frozen *ice)
 {
-        if (ice->magic != mk_signature())
+        if (ice->magic != _yoink_signature())
                 return NULL;
         if (ice->base == ice)
                 return ice->root;
         ptrdiff_t offset = (void *)ice - ice->base;
-        for (struct header *head = (void *)ice->data;
-             (void *)head < (void *)ice + ice->length;
-             head = (void *)head + sizeof(struct header) + head->tsz) {
-                for (int i = 0; i < head->nptrs; i++)
-                        head->data[i + head->bptrs] += offset;
-        }
-        ice->root += offset;
-        ice->base += offset;
-        assert(ice->base == ice);
-        return ice->root;
+        if (ice->relocs)
+                _yoink_rebase((uintptr_t *)ice, (uint64_t *)((char *)ice + ice->relocs),
+                       ice->relocs / sizeof(void *), offset);
+        else if (!thaw_objects((char *)ice->data, (char *)ice + ice->length,
+                               (char *)ice + ice->length, (uintptr_t)ice->base, ice->length, offset))
+                return NULL;
+        return _yoink_thaw_finish(ice);
+}
+
+/* the slab header goes over the start of the frozen header and what is left of
+ * it becomes an object of its own, the objects of the image then follow in
+ * the slab as if they had been carved out of it. The relocation bitmap is past
+ * the end of the slab. */
+_Static_assert(sizeof(struct frozen) - sizeof(struct slab) >= sizeof(struct header) + sizeof(void *) &&
+               (sizeof(struct frozen) - sizeof(struct slab)) % sizeof(void *) == 0,
+               "frozen header too small to hold a slab header");
+
+void *
+yoink_thaw_into_arena(Arena *arena, struct frozen *ice)
+{
+        if (ice->magic != _yoink_signature())
+                return NULL;
+        void *root = yoink_thaw(ice);
+        size_t size = (ice->relocs ? ice->relocs : ice->length) - sizeof(struct slab);
+        struct slab *s = (struct slab *)ice;
+        _head_init(s->data, sizeof(struct frozen) - sizeof(struct slab) - sizeof(struct header), 0, 0);
+        s->size = size;
+        atomic_init(&s->used, size);
+        atomic_init(&s->end, size);
+        _arena_add_slab(arena, s);
+        return root;
+}
+
+/* frozen data that is streamed out is relocated against a base user space
+ * never reaches, so no NULL or aliased pointer can be mistaken for one into
+ * the image. */
+#define STREAM_BASE ((uintptr_t)1 << (sizeof(uintptr_t) * 8 - 1))
+
+/* files are relocated against a page aligned address picked at random from
+ * the middle of the 47 bit user address space, away from where the heap and
+ * mmap put things, so a later yoink_thaw_mmap can usually map them there and
+ * skip relocation. */
+static uintptr_t
+file_base(void)
+{
+#if UINTPTR_MAX > 0xffffffffu
+        static _Atomic uintptr_t count;
+        uintptr_t h = hash_uintptr(time(NULL) ^ hash_uintptr((uintptr_t)&count + ++count));
+        return ((uintptr_t)1 << 44) + (h % (3 << 14)) * ((uintptr_t)1 << 30);
+#else
+        return STREAM_BASE;
+#endif
+}
+/* size of the buffer the stream is written through, a multiple of the word
+ * size so pointer fields are never split. */
+#define STREAM_CHUNK (1 << 20)
+
+struct stream {
+        ssize_t (*write)(void *arg, const void *buf, size_t len);
+        void *arg;
+        uintptr_t base;         // what pointers into the image are relative to
+        char *chunk;
+        size_t fill;
+        size_t total;
+        uint64_t *relocs;       // relocation bitmap, sent after the objects
+        size_t image;           // length of the image checksummed, 0 if it isn't
+        uint32_t crc;           // crc32c of what has been sent of the image
+        bool error;
+};
+
+static void
+stream_flush(struct stream *st)
+{
+        if (st->total < st->image)
+                st->crc = crc32c(st->crc, st->chunk,
+                                 st->image - st->total < st->fill ? st->image - st->total : st->fill);
+        for (size_t done = 0; done < st->fill && !st->error;) {
+                ssize_t n = st->write(st->arg, st->chunk + done, st->fill - done);
+                if (n <= 0)
+                        st->error = true;
+                else
+                        done += n;
+        }
+        st->total += st->fill;
+        st->fill = 0;
+}
+
+/* send an object through the chunk buffer a piece at a time, relocating the
+ * pointer fields in each piece. */
+static void
+stream_object(struct stream *st, struct layout *lo, struct header *head)
+{
+        char *start = _head_start(head);
+        size_t prefix = (char *)head->data - start, size = prefix + _head_tsz(head);
+        /* pointer fields as byte offsets from start */
+        size_t ps = prefix + _head_bptrs(head) * sizeof(void *);
+        size_t pe = ps + _head_nptrs(head) * sizeof(void *);
+        bool nullkids = head->flags & YFLAG_NULL_CHILDREN;
+        for (size_t off = 0; off < size && !st->error;) {
+                if (st->fill == STREAM_CHUNK)
+                        stream_flush(st);
+                size_t n = size - off < STREAM_CHUNK - st->fill ? size - off : STREAM_CHUNK - st->fill;
+                char *out = st->chunk + st->fill;
+                memcpy(out, start + off, n);
+                for (size_t f = ps > off ? ps : off; f < pe && f < off + n; f += sizeof(void *)) {
+                        void **pp = (void **)(out + f - off);
+                        if (nullkids)
+                                *pp = NULL;
+                        else if (_yoink_follow(pp)) {
+                                *pp = (void *)(st->base + *ht_get(&lo->ht, (uintptr_t)*pp));
+                                size_t w = (st->total + ((char *)pp - st->chunk)) / sizeof(void *);
+                                st->relocs[w / 64] |= (uint64_t)1 << w % 64;
+                        }
+                }
+                st->fill += n;
+                off += n;
+        }
+}
+
+/* append raw bytes to the stream */
+static void
+stream_bytes(struct stream *st, const void *p, size_t len)
+{
+        while (len && !st->error) {
+                if (st->fill == STREAM_CHUNK)
+                        stream_flush(st);
+                size_t n = len < STREAM_CHUNK - st->fill ? len : STREAM_CHUNK - st->fill;
+                memcpy(st->chunk + st->fill, p, n);
+                st->fill += n;
+                p = (const char *)p + n;
+                len -= n;
+        }
+}
+
+/* the page index of a file, for each _YOINK_PAGE of the image the offset of
+ * the object covering its start or, when none does, the next object. */
+static void
+layout_page_index(struct layout *lo, size_t len, rb_t *index)
+{
+        size_t npages = (len + _YOINK_PAGE - 1) / _YOINK_PAGE, page = 1;
+        RB_PUSH(uint64_t, index) = sizeof(struct frozen);
+        RB_FOR(struct header *, ph, &lo->objs) {
+                struct header *head = *ph;
+                size_t data = *ht_get(&lo->ht, (uintptr_t)head->data);
+                size_t start = data - ((char *)head->data - (char *)_head_start(head));
+                for (; page < npages && page * _YOINK_PAGE < data + _head_tsz(head); page++)
+                        RB_PUSH(uint64_t, index) = start;
+        }
+        for (; page < npages; page++)
+                RB_PUSH(uint64_t, index) = lo->len;
+}
+
+/* when fd is a seekable descriptor the stream goes to, the header is marked
+ * as checksummed and the crc accumulated as the image is sent is written back
+ * into it at the end. pwrite on a descriptor opened with O_APPEND appends
+ * whatever the offset so those count as unseekable. */
+static ssize_t
+freeze_stream(void *root, uintptr_t base, ssize_t (*write)(void *arg, const void *buf, size_t len),
+              void *arg, bool indexed, int fd)
+{
+        off_t start = fd < 0 || fcntl(fd, F_GETFL) & O_APPEND ? -1 : lseek(fd, 0, SEEK_CUR);
+        struct layout lo = LAYOUT_INIT(true, sizeof(struct frozen));
+        if (!IS_RAW(root))
+                layout_graph(&lo, root, YOINK_ORDER_DFS);
+        size_t nrelocs = IS_RAW(root) ? 0 : _relocs_size(lo.len);
+        struct stream st = { .write = write, .arg = arg, .base = base, .chunk = malloc(STREAM_CHUNK),
+                             .relocs = calloc(1, nrelocs + 1), .image = start < 0 ? 0 : lo.len + nrelocs };
+        if (!st.chunk || !st.relocs) {
+                free(st.chunk);
+                free(st.relocs);
+                layout_free(&lo);
+                return -1;
+        }
+        struct frozen *fz = (struct frozen *)st.chunk;
+        fz->magic = _yoink_signature();
+        fz->length = lo.len + nrelocs;
+        fz->base = (void *)base;
+        fz->relocs = nrelocs ? lo.len : 0;
+        fz->crc = 0;
+        fz->flags = start < 0 ? 0 : YOINK_FROZEN_CRC;
+        fz->root = IS_RAW(root) ? root : (void *)(base + *ht_get(&lo.ht, (uintptr_t)root));
+        st.fill = sizeof(struct frozen);
+        RB_FOR(struct header *, ph, &lo.objs)
+                if (!st.error)
+                        stream_object(&st, &lo, *ph);
+        stream_bytes(&st, st.relocs, nrelocs);
+        free(st.relocs);
+        if (indexed) {
+                rb_t index = RB_BLANK;
+                layout_page_index(&lo, lo.len + nrelocs, &index);
+                stream_bytes(&st, rb_ptr(&index), rb_len(&index));
+                struct _yoink_trailer tr = {
+                        _yoink_signature() ^ _YOINK_TRAILER_MAGIC, RB_NITEMS(uint64_t, &index)
+                };
+                stream_bytes(&st, &tr, sizeof(tr));
+                rb_free(&index);
+        }
+        stream_flush(&st);
+        if (start >= 0 && !st.error &&
+            pwrite(fd, &st.crc, sizeof(st.crc), start + offsetof(struct frozen, crc)) != sizeof(st.crc))
+                st.error = true;
+        free(st.chunk);
+        layout_free(&lo);
+        return st.error ? -1 : (ssize_t)st.total;
+}
+
+ssize_t
+yoink_freeze_stream(void *root, ssize_t (*write)(void *arg, const void *buf, size_t len), void *arg)
+{
+        return freeze_stream(root, STREAM_BASE, write, arg, false, -1);
+}
+
+struct frozen *
+yoink_thaw_stream(ssize_t (*read)(void *arg, void *buf, size_t len), void *arg)
+{
+        struct frozen head;
+        for (size_t have = 0; have < sizeof(head);) {
+                ssize_t n = read(arg, (char *)&head + have, sizeof(head) - have);
+                if (n <= 0)
+                        return NULL;
+                have += n;
+        }
+        if (head.magic != _yoink_signature() || head.length < sizeof(head))
+                return NULL;
+        struct frozen *ice = malloc(head.length);
+        if (!ice)
+                return NULL;
+        *ice = head;
+        ptrdiff_t offset = (char *)ice - (char *)head.base;
+        char *have = (char *)ice->data, *done = have, *end = (char *)ice + head.length;
+        /* the walk doesn't need a relocation bitmap, just stops short of it */
+        char *objs = head.relocs && head.relocs < head.length ? (char *)ice + head.relocs : end;
+        while (have < end) {
+                ssize_t n = read(arg, have, end - have < STREAM_CHUNK ? end - have : STREAM_CHUNK);
+                if (n <= 0) {
+                        free(ice);
+                        return NULL;
+                }
+                have += n;
+                /* thaw whatever has arrived while waiting for the rest */
+                done = thaw_objects(done, have < objs ? have : objs, objs,
+                                    (uintptr_t)head.base, head.length, offset);
+                if (!done)
+                        break;
+        }
+        if (done != objs) {
+                free(ice);
+                return NULL;
+        }
+        _yoink_thaw_finish(ice);
+        return ice;
+}
+
+static ssize_t
+fd_write(void *arg, const void *buf, size_t len)
+{
+        ssize_t n;
+        while ((n = write(*(int *)arg, buf, len)) < 0 && errno == EINTR)
+                ;
+        return n;
+}
+
+static ssize_t
+fd_read(void *arg, void *buf, size_t len)
+{
+        ssize_t n;
+        while ((n = read(*(int *)arg, buf, len)) < 0 && errno == EINTR)
+                ;
+        return n;
+}
+
+ssize_t
+yoink_freeze_fd(void *root, int fd)
+{
+        return freeze_stream(root, STREAM_BASE, fd_write, &fd, false, fd);
+}
+
+struct frozen *
+yoink_thaw_fd(int fd)
+{
+        return yoink_thaw_stream(fd_read, &fd);
+}
+
+ssize_t
+yoink_freeze_file(void *root, const char *path)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0)
+                return -1;
+        ssize_t n = freeze_stream(root, file_base(), fd_write, &fd, true, fd);
+        if (close(fd) < 0)
+                n = -1;
+        return n;
 }
 
 /*
@@ -311,6 +1298,14 @@ return 0;
 */
 
 /* test code after this */
+#ifdef TESTING
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "print_util.h"
+
 struct node {
         BEGIN_PTRS;
         struct node *left;
@@ -389,10 +1384,15 @@ void arena_stats(Arena *a, long *nbytes, long *nptrs)
         long _nbytes = 0, _nptrs = 0;
         struct chain *c = a->chain;
         while (c) {
-                _nbytes += c->head.tsz;
-                _nptrs += c->head.nptrs;
+                _nbytes += _head_tsz(_CHAIN_HEAD(c));
+                _nptrs += _head_nptrs(_CHAIN_HEAD(c));
                 c = c->next;
         }
+        for (struct slab *s = a->slabs; s; s = s->next)
+                _SLAB_FOR(h, s) {
+                        _nbytes += _head_tsz(h);
+                        _nptrs += _head_nptrs(h);
+                }
         *nbytes = _nbytes;
         *nptrs = _nptrs;
 }
@@ -422,9 +1422,583 @@ long arena_nbytes(Arena *a)
         return nbytes;
 }
 
+#define BENCH_ALLOCS 1000000
+
+enum bench_mode { BENCH_CHAIN, BENCH_SLAB, BENCH_LOCAL };
+struct bench_alloc_arg {
+        Arena *arena;
+        enum bench_mode mode;
+};
+
+static void *
+bench_alloc_thread(void *varg)
+{
+        struct bench_alloc_arg *arg = varg;
+        struct node *n = NULL;
+        if (arg->mode == BENCH_LOCAL) {
+                ArenaLocal local;
+                arena_attach(&local, arg->arena);
+                for (int i = 0; i < BENCH_ALLOCS; i++) {
+                        n = ARENA_LOCAL_CALLOC(&local, *n);
+                        n->v = i;
+                }
+                arena_detach(&local);
+        } else {
+                for (int i = 0; i < BENCH_ALLOCS; i++) {
+                        n = ARENA_CALLOC(arg->arena, *n);
+                        n->v = i;
+                }
+        }
+        return n;
+}
+
+/* allocation throughput into one shared arena from 1 to maxthreads threads */
+static int
+bench_alloc(int maxthreads)
+{
+        static const char *names[] = { "chain", "slab", "local" };
+        for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+                for (enum bench_mode mode = BENCH_CHAIN; mode <= BENCH_LOCAL; mode++) {
+                        Arena arena = ARENA_INIT;
+                        if (mode != BENCH_CHAIN)
+                                arena.slab_size = ARENA_SLAB_SIZE;
+                        struct bench_alloc_arg arg = { &arena, mode };
+                        pthread_t threads[nthreads];
+                        char label[64];
+                        snprintf(label, sizeof(label), "%s x%i", names[mode], nthreads);
+                        timeit(NULL);
+                        for (int i = 0; i < nthreads; i++)
+                                pthread_create(&threads[i], NULL, bench_alloc_thread, &arg);
+                        for (int i = 0; i < nthreads; i++)
+                                pthread_join(threads[i], NULL);
+                        timeit(label);
+                        assert(arena_nbytes(&arena) == (long)nthreads * BENCH_ALLOCS * sizeof(struct node));
+                        arena_free(&arena);
+                }
+        }
+        return 0;
+}
+
+/* build a random graph of n nodes where each node points to two earlier ones,
+ * the last node reaches nearly all of them. */
+static struct node *
+random_graph(Arena *arena, int n)
+{
+        struct node **nodes = malloc(n * sizeof(*nodes));
+        for (int i = 0; i < n; i++) {
+                struct node *nd = ARENA_CALLOC(arena, *nd);
+                nd->v = i;
+                if (i) {
+                        nd->left = nodes[i - 1 - rand() % (i < 16 ? i : 16)];
+                        nd->right = nodes[rand() % i];
+                }
+                nodes[i] = nd;
+        }
+        struct node *root = nodes[n - 1];
+        free(nodes);
+        return root;
+}
+
+/* check two graphs have the same shape and values, returns number of nodes */
+static long
+compare_graph(struct node *a, struct node *b)
+{
+        HashTable seen = HASHMAP_INIT;
+        rb_t stack = RB_BLANK;
+        long count = 0;
+        RB_PUSH(struct node *, &stack) = a;
+        RB_PUSH(struct node *, &stack) = b;
+        while (rb_len(&stack)) {
+                struct node *nb = RB_MPOP(struct node *, &stack, NULL);
+                struct node *na = RB_MPOP(struct node *, &stack, NULL);
+                if (!na || !nb) {
+                        assert(na == nb);
+                        continue;
+                }
+                Value *v;
+                if (!ht_ins(&seen, (uintptr_t)na, &v)) {
+                        assert(*v == (uintptr_t)nb);
+                        continue;
+                }
+                *v = (uintptr_t)nb;
+                assert(na->v == nb->v);
+                count++;
+                RB_PUSH(struct node *, &stack) = na->left;
+                RB_PUSH(struct node *, &stack) = nb->left;
+                RB_PUSH(struct node *, &stack) = na->right;
+                RB_PUSH(struct node *, &stack) = nb->right;
+        }
+        rb_free(&stack);
+        ht_free(&seen);
+        return count;
+}
+
+/* serial against parallel yoinks of a large graph */
+static int
+bench_yoink(int maxthreads, int n)
+{
+        Arena arena = ARENA_SLAB_INIT;
+        struct node *root = random_graph(&arena, n);
+        char label[64];
+        Arena to = ARENA_SLAB_INIT;
+        void *roots[1] = { root };
+        timeit(NULL);
+        ssize_t serial = yoinks_to_arena(&to, 1, roots);
+        timeit("yoinks_to_arena");
+        printf("nodes: %li\n", compare_graph(root, roots[0]));
+        arena_free(&to);
+        for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+                roots[0] = root;
+                snprintf(label, sizeof(label), "parallel arena x%i", nthreads);
+                timeit(NULL);
+                ssize_t par = yoinks_to_arena_parallel(&to, 1, roots, nthreads);
+                timeit(label);
+                assert(par == serial);
+                compare_graph(root, roots[0]);
+                arena_free(&to);
+        }
+        size_t slen, plen;
+        timeit(NULL);
+        void *sm = yoink_to_malloc(root, &slen);
+        timeit("yoink_to_malloc");
+        compare_graph(root, sm);
+        free(sm);
+        for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+                snprintf(label, sizeof(label), "parallel malloc x%i", nthreads);
+                timeit(NULL);
+                void *pm = yoink_to_malloc_parallel(root, &plen, nthreads);
+                timeit(label);
+                assert(plen == slen);
+                compare_graph(root, pm);
+                free(pm);
+        }
+        arena_free(&arena);
+        return 0;
+}
+
+static struct node *
+bst_insert(Arena *arena, struct node *root, int v)
+{
+        struct node **p = &root;
+        while (*p && (*p)->v != v)
+                p = v < (*p)->v ? &(*p)->left : &(*p)->right;
+        if (!*p) {
+                *p = ARENA_CALLOC(arena, **p);
+                (*p)->v = v;
+        }
+        return root;
+}
+
+static long
+bst_sum(struct node *n)
+{
+        return n ? n->v + bst_sum(n->left) + bst_sum(n->right) : 0;
+}
+
+/* buckets[1] holds an object whose pointers start past what a small header
+ * can describe, word 0 of it is not a pointer. */
+static long
+wide_check(void **buckets, int nb)
+{
+        void **far = buckets[1];
+        assert(far[0] == (void *)12344 && far[150] == buckets[0]);
+        long sum = 0;
+        for (int i = 0; i < nb; i += 10)
+                sum += ((struct node *)buckets[i])->v;
+        return sum;
+}
+
+struct stream_arg {
+        void *root;
+        int fd;
+};
+
+static void *
+stream_writer(void *varg)
+{
+        struct stream_arg *sa = varg;
+        ssize_t n = yoink_freeze_fd(sa->root, sa->fd);
+        close(sa->fd);
+        return (void *)n;
+}
+
+/* a complete tree with every node at the same depth equal */
+static struct node *
+full_tree(Arena *arena, int depth)
+{
+        if (!depth)
+                return NULL;
+        struct node *n = ARENA_CALLOC(arena, *n);
+        n->v = depth;
+        n->left = full_tree(arena, depth - 1);
+        n->right = full_tree(arena, depth - 1);
+        return n;
+}
+
+/* append keys to an archive alongside other threads doing the same */
+struct append_arg {
+        const char *path;
+        int id;
+};
+
+static void *
+archive_appender(void *varg)
+{
+        struct append_arg *aa = varg;
+        Arena mine = ARENA_SLAB_INIT;
+        for (int i = 0; i < 20; i++) {
+                char key[16];
+                snprintf(key, sizeof(key), "t%i.%i", aa->id, i);
+                void *root = bst_insert(&mine, NULL, aa->id * 100 + i);
+                assert(!yoink_archive_append(aa->path, 1, (const char *[]){ key }, &root));
+        }
+        arena_free(&mine);
+        return NULL;
+}
+
+/* yoink a tree into a shared arena many times over, every copy but the
+ * first finds the tree already there */
+struct shared_arg {
+        Arena *to;
+        struct node *root;
+};
+
+static void *
+shared_yoinker(void *varg)
+{
+        struct shared_arg *sa = varg;
+        Arena mine = ARENA_SLAB_INIT;
+        for (int i = 0; i < 200; i++) {
+                struct node *copy = yoink_to_arena(&mine, sa->root);
+                void *root = copy;
+                yoinks_to_arena(sa->to, 1, &root);
+                assert(yoinks_to_arena(sa->to, 1, &root) == 0 && arena_contains(sa->to, root));
+                compare_tree(copy, root);
+                arena_free(&mine);
+        }
+        return NULL;
+}
+
+static long
+bst_lookups(struct node *root, int nlookups, int range)
+{
+        long found = 0;
+        srand(1);
+        for (int i = 0; i < nlookups; i++) {
+                int v = rand() % range;
+                struct node *n = root;
+                while (n && n->v != v)
+                        n = v < n->v ? n->left : n->right;
+                found += !!n;
+        }
+        return found;
+}
+
+/* walking a search tree after compacting it with each layout order */
+static int
+bench_order(int n)
+{
+        static const char *names[] = { "dfs", "bfs", "clustered" };
+        Arena arena = ARENA_SLAB_INIT;
+        struct node *root = NULL;
+        /* allocate in random order so the arena layout is scattered */
+        for (int i = 0; i < n; i++)
+                root = bst_insert(&arena, root, rand() % (4 * n));
+        char label[64];
+        timeit(NULL);
+        long sum = bst_sum(root), found = bst_lookups(root, n, 4 * n);
+        timeit("arena walk");
+        for (enum yoink_order order = YOINK_ORDER_DFS; order <= YOINK_ORDER_CLUSTERED; order++) {
+                size_t len;
+                struct node *c = yoink_to_malloc_ordered(root, &len, order);
+                timeit(NULL);
+                assert(bst_sum(c) == sum);
+                timeit(NULL);
+                for (int i = 0; i < 5; i++)
+                        assert(bst_sum(c) == sum);
+                snprintf(label, sizeof(label), "%s traverse", names[order]);
+                timeit(label);
+                assert(bst_lookups(c, n, 4 * n) == found);
+                snprintf(label, sizeof(label), "%s lookup", names[order]);
+                timeit(label);
+                free(c);
+        }
+        arena_free(&arena);
+        return 0;
+}
+
+static double
+seconds(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* every rebase kernel against the scalar one on random bitmaps of every
+ * density, including lengths that end mid block */
+static void
+rebase_check(void)
+{
+        void (*kernels[])(uintptr_t *, const uint64_t *, size_t, uintptr_t) = {
+                rebase_scalar, _yoink_rebase,
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+                rebase_sse2,
+#endif
+        };
+        for (size_t n = 1; n < 700; n += 37) {
+                uint64_t bits[(n + 63) / 64];
+                uintptr_t words[n], want[n];
+                for (int density = 0; density <= 4; density++) {
+                        memset(bits, 0, sizeof(bits));
+                        for (size_t i = 0; i < n; i++) {
+                                words[i] = rand();
+                                if (rand() % 4 < density)
+                                        bits[i / 64] |= (uint64_t)1 << i % 64;
+                        }
+                        memcpy(want, words, sizeof(words));
+                        rebase_scalar(want, bits, n, 0x1230);
+                        for (int k = 1; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                                uintptr_t got[n];
+                                memcpy(got, words, sizeof(words));
+                                kernels[k](got, bits, n, 0x1230);
+                                assert(!memcmp(got, want, sizeof(want)));
+                        }
+                }
+        }
+}
+
+/* thaw throughput relocating by header walk and by relocation bitmap */
+static int
+bench_thaw(int n, int maxthreads)
+{
+        Arena arena = ARENA_SLAB_INIT;
+        struct node *root = NULL;
+        for (int i = 0; i < n; i++)
+                root = bst_insert(&arena, root, rand() % (4 * n));
+        long sum = bst_sum(root);
+        struct frozen *ice = yoink_freeze(root, NULL);
+        struct frozen *copy = malloc(ice->length);
+        printf("image: %lu bytes, %lu of bitmap\n", (unsigned long)ice->length,
+               (unsigned long)(ice->length - ice->relocs));
+        enum { WALK, SCALAR, BEST, NMODES };
+        static const char *names[] = { "header walk", "bitmap scalar", "bitmap simd" };
+        for (int mode = 0; mode < NMODES; mode++) {
+                double t = 0;
+                for (int rep = 0; rep < 10; rep++) {
+                        memcpy(copy, ice, ice->length);
+                        ptrdiff_t offset = (char *)copy - (char *)ice;
+                        double start = seconds();
+                        if (mode == WALK)
+                                thaw_objects((char *)copy->data, (char *)copy + copy->relocs,
+                                             (char *)copy + copy->relocs, (uintptr_t)ice, ice->length, offset);
+                        else
+                                (mode == SCALAR ? rebase_scalar : _yoink_rebase)((uintptr_t *)copy,
+                                        (uint64_t *)((char *)copy + copy->relocs),
+                                        copy->relocs / sizeof(void *), offset);
+                        t += seconds() - start;
+                        assert(bst_sum(_yoink_thaw_finish(copy)) == sum);
+                }
+                printf("%-24s %10.3f GB/s\n", names[mode], 10 * ice->relocs / t / 1e9);
+        }
+        char label[64];
+        for (int nthreads = 2; nthreads <= maxthreads; nthreads *= 2) {
+                double t = 0;
+                for (int rep = 0; rep < 10; rep++) {
+                        memcpy(copy, ice, ice->length);
+                        double start = seconds();
+                        assert(yoink_thaw_parallel(copy, nthreads));
+                        t += seconds() - start;
+                }
+                snprintf(label, sizeof(label), "bitmap x%i", nthreads);
+                printf("%-24s %10.3f GB/s\n", label, 10 * ice->relocs / t / 1e9);
+        }
+        free(copy);
+        double t = seconds();
+        for (int rep = 0; rep < 10; rep++)
+                assert(crc32c(0, ice, ice->length) == crc32c(0, ice, ice->length));
+        printf("%-24s %10.3f GB/s\n", "crc32c", 20.0 * ice->length / (seconds() - t) / 1e9);
+        t = seconds();
+        for (int rep = 0; rep < 10; rep++)
+                crc32c_sw(0, ice, ice->length);
+        printf("%-24s %10.3f GB/s\n", "crc32c table", 10.0 * ice->length / (seconds() - t) / 1e9);
+        t = seconds();
+        for (int rep = 0; rep < 10; rep++)
+                assert(thaw_bounds_ok(ice));
+        printf("%-24s %10.3f GB/s\n", "bounds check", 10.0 * ice->length / (seconds() - t) / 1e9);
+        size_t plen;
+        timeit(NULL);
+        void *packed = yoink_pack(ice, &plen);
+        timeit("pack");
+        printf("packed: %lu -> %lu\n", (unsigned long)ice->length, (unsigned long)plen);
+        for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+                snprintf(label, sizeof(label), "unpack x%i", nthreads);
+                timeit(NULL);
+                struct frozen *up = yoink_unpack(packed, plen, nthreads);
+                timeit(label);
+                assert(bst_sum(yoink_thaw(up)) == sum);
+                free(up);
+        }
+        free(packed);
+        free(ice);
+        timeit(NULL);
+        ice = yoink_freeze(root, NULL);
+        timeit("freeze");
+        free(ice);
+        timeit(NULL);
+        ice = yoink_freeze_flags(root, NULL, 0);
+        timeit("freeze without crc");
+        free(ice);
+        for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+                snprintf(label, sizeof(label), "freeze x%i", nthreads);
+                timeit(NULL);
+                ice = yoink_freeze_parallel(root, nthreads);
+                timeit(label);
+                assert(bst_sum(yoink_thaw(ice)) == sum);
+                free(ice);
+        }
+        arena_free(&arena);
+        return 0;
+}
+
+/* arena_vacuums as it was before marking in the headers, a hash set of every
+ * live object, kept to compare against. */
+static ssize_t
+vacuums_hashset(Arena *bowl, int nroots, void *root[nroots])
+{
+        rb_t stack = RB_BLANK;
+        HashTable ht = HASHSET_INIT;
+        /* if we don't want to copy we have to seed the table with pointers
+         * already in target */
+        for (int i = 0; i < nroots; i++)
+                RB_PUSH(void **, &stack) = &root[i];
+        RB_FOR_ENUM(void **, pnp, &stack) {
+                void **np = *pnp.v;
+                if (IS_RAW(*np))
+                        continue;
+                /* aliasing means nothing here as nothing is copied */
+                struct header *head = container_of(*np, struct header, data);
+                if (head->flags & YFLAG_NULL_SELF) {
+                        *np = NULL;
+                        continue;
+                }
+                if (ht_add(&ht, (uintptr_t)*np)) {
+                        if (!_yoink_null_children(head))
+                                for (size_t i = 0; i < _head_nptrs(head); i++)
+                                        RB_PUSH(void **, &stack) = &head->data[_head_bptrs(head) + i];
+                }
+        }
+        rb_free(&stack);
+        _arena_index_drop(bowl);
+        struct chain *chain = bowl->chain;
+        struct chain **pch = &chain;
+        ssize_t freed  = 0;
+        while (*pch) {
+                struct chain *next = pch[0]->next;
+                struct header *head = _CHAIN_HEAD(pch[0]);
+                if (!ht_in(&ht, (uintptr_t)head->data)) {
+                        freed += _head_tsz(head);
+                        free(pch[0]);
+                        *pch = next;
+                } else {
+                        pch = &pch[0]->next;
+                }
+        }
+        /* slabs can only be released once nothing in them is live, the slab
+         * being bumped is always kept. */
+        struct slab **psl = (struct slab **)&bowl->slabs;
+        while (*psl) {
+                struct slab *s = *psl;
+                ssize_t sfreed = 0;
+                bool live = s == bowl->bump;
+                _SLAB_FOR(h, s) {
+                        if (ht_in(&ht, (uintptr_t)h->data)) {
+                                live = true;
+                                break;
+                        }
+                        sfreed += _head_tsz(h);
+                }
+                if (live) {
+                        psl = &s->next;
+                } else {
+                        freed += sfreed;
+                        *psl = s->next;
+                        free(s);
+                }
+        }
+        bowl->chain = chain;
+        ht_free(&ht);
+        return freed;
+}
+
+/* an arena of n objects of which one in ndead + 1 is reachable from the
+ * returned root, the garbage points into the live ones. */
+static struct node *
+garbage_arena(Arena *arena, bool slab, int n, int ndead)
+{
+        *arena = (Arena)ARENA_INIT;
+        arena->slab_size = slab ? ARENA_SLAB_SIZE : 0;
+        srand(1);
+        struct node *root = random_graph(arena, n / (ndead + 1));
+        for (int i = n / (ndead + 1); i < n; i++) {
+                struct node *dead = ARENA_CALLOC(arena, *dead);
+                dead->left = root;
+        }
+        return root;
+}
+
+/* vacuum an arena of n objects, ndead garbage for each live one, with the
+ * hash set, with header marks and with the sweep left for later. */
+static int
+bench_vacuum(int n, int ndead)
+{
+        static const char *names[] = { "chain", "slab" };
+        for (int slab = 0; slab < 2; slab++) {
+                ssize_t freed[2];
+                Arena arena;
+                char label[64];
+                for (int mark = 0; mark < 2; mark++) {
+                        struct node *root = garbage_arena(&arena, slab, n, ndead);
+                        snprintf(label, sizeof(label), "%s %s", names[slab], mark ? "mark" : "hashset");
+                        timeit(NULL);
+                        freed[mark] = mark ? arena_vacuums(&arena, 1, (void **)&root)
+                                           : vacuums_hashset(&arena, 1, (void **)&root);
+                        timeit(label);
+                        arena_free(&arena);
+                }
+                assert(freed[0] == freed[1]);
+                struct node *root = garbage_arena(&arena, slab, n, ndead);
+                snprintf(label, sizeof(label), "%s lazy pause", names[slab]);
+                timeit(NULL);
+                arena_vacuums_lazy(&arena, 1, (void **)&root);
+                timeit(label);
+                snprintf(label, sizeof(label), "%s lazy sweep", names[slab]);
+                ssize_t lfreed = 0;
+                while (arena_sweep_pending(&arena))
+                        lfreed += arena_sweep_step(&arena, 1 << 20);
+                timeit(label);
+                assert(lfreed == freed[0]);
+                arena_free(&arena);
+        }
+        return 0;
+}
+
 #include <stdlib.h>
 int main(int argc, char *argv[])
 {
+        if (argc > 1 && !strcmp(argv[1], "bench-order"))
+                return bench_order(argc > 2 ? atoi(argv[2]) : 1000000);
+        if (argc > 1 && !strcmp(argv[1], "bench-alloc"))
+                return bench_alloc(argc > 2 ? atoi(argv[2]) : 16);
+        if (argc > 1 && !strcmp(argv[1], "bench-thaw"))
+                return bench_thaw(argc > 2 ? atoi(argv[2]) : 1000000,
+                                  argc > 3 ? atoi(argv[3]) : 4);
+        if (argc > 1 && !strcmp(argv[1], "bench-yoink"))
+                return bench_yoink(argc > 2 ? atoi(argv[2]) : 16,
+                                   argc > 3 ? atoi(argv[3]) : 1000000);
+        if (argc > 1 && !strcmp(argv[1], "bench-vacuum"))
+                return bench_vacuum(argc > 2 ? atoi(argv[2]) : 10000000,
+                                    argc > 3 ? atoi(argv[3]) : 1);
         Arena arena = ARENA_INIT;
         struct node *root = NULL;
         for (int i = 0; i < 100; i++)
@@ -476,7 +2050,639 @@ int main(int argc, char *argv[])
         printf("nbytes_afterY: %lu\n", arena_nbytes(&arena2));
         arena_free(&arena);
         arena_free(&arena2);
+        /* the same again with slab arenas */
+        Arena slab = ARENA_SLAB_INIT, slab2 = ARENA_SLAB_INIT;
+        root = NULL;
+        for (int i = 0; i < 10000; i++)
+                root = insert_tree(&slab, root, rand() % 1000);
+        printf("slab_before: %lu\n", arena_nbytes(&slab));
+        root2 = yoink_to_arena(&slab2, root);
+        compare_tree(root, root2);
+        roots[0] = root;
+        printf("slab_vacuumed: %li\n", (long)arena_vacuums(&slab, 1, roots));
+        printf("slab_afterV: %lu\n", arena_nbytes(&slab));
+        printf("slab_afterY: %lu\n", arena_nbytes(&slab2));
+        arena_free(&slab);
+        arena_free(&slab2);
+        /* destructive yoink out of a cyclic tree */
+        root = NULL;
+        for (int i = 0; i < 10000; i++)
+                root = insert_tree(&slab, root, rand() % 1000);
+        root->left->right = root;
+        root2 = yoink_to_arena(&arena2, root);
+        /* already in arena2 so nothing should be copied */
+        roots[0] = root2;
+        assert(yoinks_to_arena(&arena2, 1, roots) == 0 && roots[0] == root2);
+        assert(arena_contains(&arena2, root2) && !arena_contains(&arena2, root));
+        roots[0] = root;
+        printf("destructive: %li\n", (long)yoinks_to_arena_destructive(&slab2, 1, roots));
+        arena_free(&slab);
+        root = roots[0];
+        assert(root->left->right == root);
+        root->left->right = NULL;
+        root2->left->right = NULL;
+        compare_tree(root, root2);
+        printf("destructive_after: %lu\n", arena_nbytes(&slab2));
+        arena_free(&slab2);
+        arena_free(&arena2);
+        /* generational, link new nodes into tenured ones */
+        YoinkGen gen = YOINKGEN_INIT;
+        root = NULL;
+        for (int i = 0; i < 1000; i++)
+                root = bst_insert(&gen.nursery, root, rand() % 1000);
+        long sum = bst_sum(root);
+        roots[0] = root;
+        printf("promoted: %li\n", (long)yoink_minor(&gen, 1, roots));
+        root = roots[0];
+        assert(arena_contains(&gen.tenured, root) && bst_sum(root) == sum);
+        for (int i = 0; i < 100; i++) {
+                struct node *n = root;
+                int v = rand() % 2000;
+                while (n->v != v) {
+                        struct node **next = v < n->v ? &n->left : &n->right;
+                        if (!*next) {
+                                struct node *nn = ARENA_CALLOC(&gen.nursery, *nn);
+                                nn->v = v;
+                                yoink_write(&gen, n, (void **)next, nn);
+                                sum += v;
+                        }
+                        n = *next;
+                }
+        }
+        printf("promoted2: %li\n", (long)yoink_minor(&gen, 1, roots));
+        assert(roots[0] == root && bst_sum(root) == sum);
+        /* objects in other arenas are traced where they are, not moved */
+        Arena third = ARENA_SLAB_INIT;
+        struct node *ext = bst_insert(&third, NULL, 7);
+        ext->left = bst_insert(&gen.nursery, NULL, 3);
+        ext->right = root;
+        roots[0] = ext;
+        assert(yoink_minor(&gen, 1, roots) == sizeof(struct node));
+        assert(roots[0] == ext && ext->v == 7 && ext->right == root);
+        assert(!(yoink_header(ext)->flags & YFLAG_FORWARDED));
+        assert(arena_contains(&gen.tenured, ext->left) && ext->left->v == 3 && !ext->left->left);
+        arena_free(&third);
+        roots[0] = root;
+        root->left = NULL;
+        printf("major: %li\n", (long)yoink_major(&gen, 1, roots));
+        yoink_gen_free(&gen);
+        /* incremental, mutating the tree between steps */
+        root = NULL;
+        for (int i = 0; i < 10000; i++)
+                root = bst_insert(&arena, root, rand() % 100000);
+        roots[0] = root;
+        YoinkIncr *inc = yoink_begin(&arena2, 1, roots);
+        int steps = 0;
+        while (!yoink_step(inc, 1024)) {
+                struct node *n = root;
+                int v = rand() % 100000;
+                while (n->v != v) {
+                        struct node **next = v < n->v ? &n->left : &n->right;
+                        if (!*next) {
+                                struct node *nn = ARENA_CALLOC(&arena, *nn);
+                                nn->v = v;
+                                yoink_incr_write(inc, n, (void **)next, nn);
+                        }
+                        n = *next;
+                }
+                steps++;
+        }
+        printf("incremental: %i steps %li\n", steps, (long)yoink_finish(inc));
+        assert(bst_sum(roots[0]) == bst_sum(root));
+        compare_graph(root, roots[0]);
+        arena_free(&arena2);
+        /* finishing with fields still queued and a changed object */
+        struct node *tri = bst_insert(&arena, bst_insert(&arena, bst_insert(&arena, NULL, 2), 1), 3);
+        roots[0] = tri;
+        inc = yoink_begin(&arena2, 1, roots);
+        yoink_touch(inc, tri);
+        assert(yoink_finish(inc) == 3 * sizeof(struct node));
+        assert(arena_nbytes(&arena2) == 3 * sizeof(struct node));
+        compare_graph(tri, roots[0]);
+        arena_free(&arena2);
+        /* copy policies */
+        root = NULL;
+        int keys[] = { 50, 25, 75, 90, 80, 95, 60, 10, 30 };
+        for (int i = 0; i < 9; i++)
+                root = bst_insert(&arena, root, keys[i]);
+        struct node *cut = root->left, *shared = root->right, *leaf = shared->right;
+        yoink_set_flags(cut, YFLAG_NULL_SELF);
+        yoink_set_flags(shared, YFLAG_ALIAS_SELF);
+        yoink_set_flags(leaf, YFLAG_NULL_CHILDREN);
+        root2 = yoink_to_arena(&arena2, root);
+        assert(!root2->left && root2->right == shared && !arena_contains(&arena2, shared));
+        root2 = yoink_to_malloc(root, &len);
+        assert(!root2->left && root2->right == shared);
+        free(root2);
+        root2 = yoink_to_malloc_parallel(root, &len, 2);
+        assert(!root2->left && root2->right == shared);
+        free(root2);
+        yoink_set_flags(shared, YFLAG_NO_ALIAS_SELF);
+        root2 = yoink_to_malloc(root, &len);
+        assert(!root2->left && root2->right != shared && root2->right->right);
+        assert(!root2->right->right->left && !root2->right->right->right);
+        free(root2);
+        yoink_set_flags(shared, YFLAG_ALIAS_SELF);
+        struct frozen *ice = yoink_freeze(root, NULL);
+        struct frozen *ice2 = malloc(ice->length);
+        memcpy(ice2, ice, ice->length);
+        free(ice);
+        root2 = yoink_thaw(ice2);
+        assert(!root2->left && root2->right == shared);
+        free(ice2);
+        yoink_set_flags(shared, YFLAG_NO_ALIAS_SELF);
+        assert(yoink_set_flags(root, 0) == 0);
+        roots[0] = root;
+        arena_vacuums(&arena, 1, roots);
+        assert(!root->left && !leaf->left && !leaf->right);
+        arena_free(&arena);
+        arena_free(&arena2);
+        /* hash consing collapses each level of a full tree to one node */
+        root = full_tree(&arena, 12);
+        sum = bst_sum(root);
+        roots[0] = root;
+        printf("interned: %li\n", (long)yoinks_to_arena_interned(&arena2, 1, roots));
+        root2 = roots[0];
+        assert(bst_sum(root2) == sum && root2->left == root2->right);
+        root2 = yoink_to_malloc_interned(root, &len);
+        printf("interned_malloc: %lu\n", len);
+        assert(bst_sum(root2) == sum && root2->left->left == root2->right->right);
+        free(root2);
+        /* a back edge only stops its holder from being shared */
+        root->left->right = root;
+        roots[0] = root;
+        yoinks_to_arena_interned(&arena2, 1, roots);
+        root2 = roots[0];
+        assert(root2->left->right == root2 && root2->left->left == root2->right->left);
+        assert(root2->left != root2->right);
+        arena_free(&arena);
+        arena_free(&arena2);
+        /* wide headers, more pointers than fit in a header */
+        int nb = 100000;
+        void **buckets = arena_alloc(&slab, nb * sizeof(void *), 0, nb);
+        void **far = arena_alloc(&slab, 200 * sizeof(void *), 150, 160);
+        for (int i = 0; i < nb; i += 10)
+                buckets[i] = bst_insert(&slab, NULL, i);
+        far[0] = (void *)12344;
+        far[150] = buckets[0];
+        buckets[1] = far;
+        sum = wide_check(buckets, nb);
+        roots[0] = buckets;
+        printf("wide: %li\n", (long)yoinks_to_arena(&slab2, 1, roots));
+        assert(roots[0] != buckets && wide_check(roots[0], nb) == sum);
+        void **wm = yoink_to_malloc(buckets, &len);
+        assert(wide_check(wm, nb) == sum);
+        free(wm);
+        wm = yoink_to_malloc_parallel(buckets, &len, 2);
+        assert(wide_check(wm, nb) == sum);
+        free(wm);
+        wm = yoink_to_malloc_interned(buckets, &len);
+        assert(wide_check(wm, nb) == sum);
+        free(wm);
+        ice = yoink_freeze(buckets, NULL);
+        ice2 = malloc(ice->length);
+        memcpy(ice2, ice, ice->length);
+        free(ice);
+        assert(wide_check(yoink_thaw(ice2), nb) == sum);
+        free(ice2);
+        roots[0] = buckets;
+        arena_vacuums(&slab, 1, roots);
+        assert(wide_check(buckets, nb) == sum);
+        arena_free(&slab2);
+        yoinks_to_arena_destructive(&slab2, 1, roots);
+        arena_free(&slab);
+        assert(wide_check(roots[0], nb) == sum);
+        arena_free(&slab2);
+        /* exact sizing and caller supplied memory */
+        root = NULL;
+        for (int i = 0; i < 1000; i++)
+                root = bst_insert(&arena, root, rand() % 1000);
+        size_t need = yoink_size(root);
+        root2 = yoink_to_malloc(root, &len);
+        assert(need == len);
+        free(root2);
+        void **buf = malloc(need + sizeof(void *));
+        buf[need / sizeof(void *)] = (void *)12344;
+        assert(!yoink_to_buffer(root, buf, need - 1));
+        assert(yoink_to_buffer(root, buf, need) == buf);
+        assert(bst_sum((struct node *)buf) == bst_sum(root) && buf[need / sizeof(void *)] == (void *)12344);
+        free(buf);
+        need = yoink_frozen_size(root);
+        ice = malloc(need);
+        ice->length = need - 1;
+        assert(!yoink_freeze(root, ice));
+        ice->length = need;
+        assert(yoink_freeze(root, ice) == ice && ice->length == need);
+        assert(bst_sum(yoink_thaw(ice)) == bst_sum(root));
+        /* a moved image is rebased by its relocation bitmap */
+        rebase_check();
+        struct frozen *moved = malloc(need);
+        memcpy(moved, ice, need);
+        assert(moved->relocs && bst_sum(yoink_thaw(moved)) == bst_sum(root));
+        free(moved);
+        /* checksums and bounds checked thaw */
+        assert(crc32c(0, "123456789", 9) == 0xE3069283 && crc32c_sw(0, "123456789", 9) == 0xE3069283);
+        for (int i = 0; i < 64; i++)
+                assert(crc32c(i, (char *)ice + i, need - 2 * i) == crc32c_sw(i, (char *)ice + i, need - 2 * i));
+        assert((ice->flags & YOINK_FROZEN_CRC) && ice->crc == yoink_frozen_crc(ice));
+        moved = malloc(need);
+        memcpy(moved, ice, need);
+        assert(!yoink_thaw_checked(moved, need - 1, YOINK_THAW_CRC | YOINK_THAW_BOUNDS));
+        ((char *)moved)[need / 2] ^= 1;
+        assert(!yoink_thaw_checked(moved, need, YOINK_THAW_CRC));
+        ((char *)moved)[need / 2] ^= 1;
+        struct node *first = (struct node *)((char *)moved + ((char *)ice->root - (char *)ice));
+        first->left = (struct node *)((char *)ice - 64);
+        assert(!yoink_thaw_checked(moved, need, YOINK_THAW_CRC));
+        moved->crc = yoink_frozen_crc(moved);
+        assert(!yoink_thaw_checked(moved, need, YOINK_THAW_BOUNDS));
+        memcpy(moved, ice, need);
+        assert(bst_sum(yoink_thaw_checked(moved, need, YOINK_THAW_CRC | YOINK_THAW_BOUNDS)) == bst_sum(root));
+        assert(!(moved->flags & YOINK_FROZEN_CRC) && !yoink_thaw_checked(moved, need, YOINK_THAW_CRC));
+        free(moved);
+        /* the checksum can be left out */
+        moved = yoink_freeze_flags(root, NULL, 0);
+        assert(moved->length == need && !moved->flags && !moved->crc);
+        assert(!yoink_thaw_checked(moved, need, YOINK_THAW_CRC));
+        assert(bst_sum(yoink_thaw_checked(moved, need, YOINK_THAW_BOUNDS)) == bst_sum(root));
+        free(moved);
+        /* parallel freeze makes an image of the same size, thawed anywhere */
+        moved = yoink_freeze_parallel(root, 3);
+        assert(moved->length == need && bst_sum(yoink_thaw(moved)) == bst_sum(root));
+        memcpy(ice, moved, need);
+        assert(bst_sum(yoink_thaw_parallel(ice, 3)) == bst_sum(root));
+        free(moved);
+        free(ice);
+        /* delta freezes */
+        YoinkSnap *snap = yoink_snap_new();
+        struct frozen_delta *deltas[3];
+        deltas[0] = yoink_freeze_delta(snap, root);
+        long sum0 = bst_sum(root);
+        for (int i = 0; i < 10; i++) {
+                struct node *n = root;
+                int v = 1000 + rand() % 1000;
+                while (n->v != v) {
+                        struct node **next = v < n->v ? &n->left : &n->right;
+                        if (!*next) {
+                                struct node *nn = ARENA_CALLOC(&arena, *nn);
+                                nn->v = v;
+                                yoink_snap_write(snap, n, (void **)next, nn);
+                        }
+                        n = *next;
+                }
+        }
+        root->v += 1;
+        yoink_snap_touch(snap, root);
+        deltas[1] = yoink_freeze_delta(snap, root);
+        long sum1 = bst_sum(root);
+        deltas[2] = yoink_freeze_delta(snap, root);
+        printf("delta: %lu %lu %lu\n", (unsigned long)deltas[0]->length,
+               (unsigned long)deltas[1]->length, (unsigned long)deltas[2]->length);
+        assert(deltas[1]->length < deltas[0]->length / 10);
+        ice = yoink_thaw_deltas(1, deltas);
+        assert(bst_sum(yoink_thaw(ice)) == sum0);
+        free(ice);
+        ice = yoink_thaw_deltas(3, deltas);
+        assert(bst_sum(yoink_thaw(ice)) == sum1);
+        free(ice);
+        assert(!yoink_thaw_deltas(2, deltas + 1));
+        for (int i = 0; i < 3; i++)
+                free(deltas[i]);
+        yoink_snap_reset(snap);
+        deltas[0] = yoink_freeze_delta(snap, root);
+        ice = yoink_thaw_deltas(1, deltas);
+        assert(bst_sum(yoink_thaw(ice)) == sum1);
+        free(ice);
+        free(deltas[0]);
+        yoink_snap_free(snap);
+        /* streaming through a pipe, with an object bigger than a chunk */
+        nb = 300000;
+        buckets = arena_alloc(&arena, nb * sizeof(void *), 0, nb);
+        for (int i = 0; i < nb; i += 10)
+                buckets[i] = bst_insert(&arena, NULL, i);
+        far = arena_alloc(&arena, 200 * sizeof(void *), 150, 160);
+        far[0] = (void *)12344;
+        far[150] = buckets[0];
+        buckets[1] = far;
+        int fds[2];
+        assert(!pipe(fds));
+        pthread_t writer;
+        struct stream_arg sa = { buckets, fds[1] };
+        pthread_create(&writer, NULL, stream_writer, &sa);
+        ice = yoink_thaw_fd(fds[0]);
+        void *written;
+        pthread_join(writer, &written);
+        close(fds[0]);
+        printf("streamed: %li\n", (long)written);
+        assert(ice && (size_t)written == ice->length && ice->length == yoink_frozen_size(buckets));
+        assert(wide_check(yoink_thaw(ice), nb) == wide_check(buckets, nb));
+        free(ice);
+        /* mapped files, at their base, lazily relocated and without an index */
+        char path[] = "/tmp/yoinkXXXXXX";
+        close(mkstemp(path));
+        ssize_t flen = yoink_freeze_file(buckets, path);
+        assert(flen > 0);
+        /* the file carries the checksum even though it was streamed */
+        int fd = open(path, O_RDONLY);
+        struct frozen *copy = malloc(flen);
+        assert(fd >= 0 && pread(fd, copy, flen, 0) == flen);
+        close(fd);
+        assert(copy->flags & YOINK_FROZEN_CRC);
+        assert(wide_check(yoink_thaw_checked(copy, copy->length, YOINK_THAW_CRC), nb) == wide_check(buckets, nb));
+        free(copy);
+        /* appending descriptors can't have the checksum written back */
+        fd = open(path, O_WRONLY | O_APPEND | O_TRUNC);
+        assert(fd >= 0 && yoink_freeze_fd(buckets, fd) == (ssize_t)yoink_frozen_size(buckets));
+        close(fd);
+        struct stat ast;
+        fd = open(path, O_RDONLY);
+        copy = yoink_thaw_fd(fd);
+        close(fd);
+        assert(copy && !(copy->flags & YOINK_FROZEN_CRC) && !stat(path, &ast) &&
+               (size_t)ast.st_size == copy->length);
+        assert(wide_check(yoink_thaw(copy), nb) == wide_check(buckets, nb));
+        free(copy);
+        /* streamed headers that are off by a byte or run past the image */
+        for (int bad = 0; bad < 2; bad++) {
+                ice = yoink_freeze(bst_insert(&arena, NULL, 1), NULL);
+                _head_at(ice->data)->tsz = bad ? INT32_MAX & ~7 : 12;
+                fd = open(path, O_WRONLY | O_TRUNC);
+                assert(fd >= 0 && write(fd, ice, ice->length) == (ssize_t)ice->length);
+                close(fd);
+                fd = open(path, O_RDONLY);
+                assert(!yoink_thaw_fd(fd));
+                close(fd);
+                free(ice);
+        }
+        assert(yoink_freeze_file(buckets, path) == flen);
+        ice = yoink_freeze_parallel(buckets, 4);
+        copy = malloc(ice->length);
+        memcpy(copy, ice, ice->length);
+        free(ice);
+        assert(wide_check(yoink_thaw_parallel(copy, 4), nb) == wide_check(buckets, nb));
+        free(copy);
+        /* packed images */
+        size_t plen;
+        ice = yoink_freeze(buckets, NULL);
+        void *packed = yoink_pack(ice, &plen);
+        printf("packed: %lu -> %lu\n", (unsigned long)ice->length, (unsigned long)plen);
+        for (int nthreads = 1; nthreads <= 3; nthreads += 2) {
+                copy = yoink_unpack(packed, plen, nthreads);
+                assert(copy && copy->length == ice->length && copy->relocs == ice->relocs);
+                assert(wide_check(yoink_thaw(copy), nb) == wide_check(buckets, nb));
+                /* and can still be moved */
+                struct frozen *moved = malloc(copy->length);
+                memcpy(moved, copy, copy->length);
+                assert(wide_check(yoink_thaw(moved), nb) == wide_check(buckets, nb));
+                free(moved);
+                free(copy);
+        }
+        assert(!yoink_unpack(packed, plen - 1, 1));
+        /* corruption is either caught or leaves an image that is still sound */
+        for (size_t at = plen / 16; at < plen; at += plen / 16) {
+                ((char *)packed)[at] ^= 0x55;
+                copy = yoink_unpack(packed, plen, 2);
+                assert(!copy || yoink_thaw_checked(copy, copy->length, YOINK_THAW_BOUNDS));
+                free(copy);
+                ((char *)packed)[at] ^= 0x55;
+        }
+        free(packed);
+        free(ice);
+        ice = yoink_thaw_mmap(path);
+        assert(ice && ice == ice->base && wide_check(yoink_thaw(ice), nb) == wide_check(buckets, nb));
+        void *taken = ice;
+        yoink_munmap(ice);
+        taken = mmap(taken, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        ice = yoink_thaw_mmap(path);
+        assert(ice && (void *)ice != taken && wide_check(yoink_thaw(ice), nb) == wide_check(buckets, nb));
+        yoink_munmap(ice);
+        ice = yoink_thaw_mmap(path);
+        void **mapped = yoink_thaw(ice);
+        assert(((void **)mapped[1])[0] == (void *)12344);
+        yoink_munmap(ice);
+        munmap(taken, 4096);
+        fd = open(path, O_WRONLY | O_TRUNC);
+        yoink_freeze_fd(buckets, fd);
+        close(fd);
+        ice = yoink_thaw_mmap(path);
+        assert(ice && wide_check(yoink_thaw(ice), nb) == wide_check(buckets, nb));
+        yoink_munmap(ice);
+        /* archives, roots appended together share structure */
+        unlink(path);
+        struct node *common = full_tree(&arena, 4);
+        struct node *pair[2] = { bst_insert(&arena, NULL, 1), bst_insert(&arena, NULL, 2) };
+        pair[0]->left = pair[1]->left = common;
+        assert(!yoink_archive_append(path, 2, (const char *[]){ "one", "two" }, (void **)pair));
+        for (int g = 0; g < 20; g++) {
+                char names[100][16];
+                const char *keys[100];
+                void *roots[100];
+                for (int i = 0; i < 100; i++) {
+                        snprintf(names[i], sizeof(names[i]), "k%i", g * 100 + i);
+                        keys[i] = names[i];
+                        roots[i] = bst_insert(&arena, NULL, g * 100 + i);
+                }
+                assert(!yoink_archive_append(path, 100, keys, roots));
+        }
+        pair[0] = bst_insert(&arena, NULL, 11);
+        assert(!yoink_archive_append(path, 1, (const char *[]){ "one" }, (void **)pair));
+        YoinkArchive *ar = yoink_archive_open(path);
+        assert(ar && yoink_archive_count(ar) == 2002);
+        for (int i = 0; i < 2000; i += 7) {
+                char key[16];
+                snprintf(key, sizeof(key), "k%i", i);
+                struct node *n = yoink_archive_get(ar, key);
+                assert(n && n->v == i);
+        }
+        struct node *one = yoink_archive_get(ar, "one"), *two = yoink_archive_get(ar, "two");
+        assert(one->v == 11 && two->v == 2 && bst_sum(two->left) == bst_sum(common));
+        assert(!yoink_archive_get(ar, "three") && yoink_archive_get(ar, "two") == two);
+        yoink_archive_close(ar);
+        /* a failed append leaves the archive as it was */
+        struct stat sb;
+        struct rlimit rl, small;
+        assert(!stat(path, &sb) && !getrlimit(RLIMIT_FSIZE, &rl));
+        signal(SIGXFSZ, SIG_IGN);
+        small = (struct rlimit) { sb.st_size + 64, rl.rlim_max };
+        assert(!setrlimit(RLIMIT_FSIZE, &small));
+        pair[0] = full_tree(&arena, 8);
+        assert(yoink_archive_append(path, 1, (const char *[]){ "big" }, (void **)pair) < 0);
+        assert(!setrlimit(RLIMIT_FSIZE, &rl));
+        signal(SIGXFSZ, SIG_DFL);
+        ar = yoink_archive_open(path);
+        assert(ar && yoink_archive_count(ar) == 2002 && !yoink_archive_get(ar, "big"));
+        assert(((struct node *)yoink_archive_get(ar, "one"))->v == 11);
+        yoink_archive_close(ar);
+        assert(!stat(path, &sb) && sb.st_size == small.rlim_cur - 64);
+        assert(!truncate(path, 100));
+        assert(!yoink_archive_open(path) && yoink_archive_append(path, 1, (const char *[]){ "x" }, (void **)pair) < 0);
+        unlink(path);
+        /* appenders take turns rather than overwriting each other */
+        struct append_arg aargs[4];
+        pthread_t appenders[4];
+        for (int i = 0; i < 4; i++) {
+                aargs[i] = (struct append_arg) { path, i };
+                assert(!pthread_create(&appenders[i], NULL, archive_appender, &aargs[i]));
+        }
+        for (int i = 0; i < 4; i++)
+                pthread_join(appenders[i], NULL);
+        ar = yoink_archive_open(path);
+        assert(ar && yoink_archive_count(ar) == 80);
+        assert(((struct node *)yoink_archive_get(ar, "t3.19"))->v == 319);
+        yoink_archive_close(ar);
+        unlink(path);
+        /* segments pointing outside themselves are refused */
+        pair[0] = bst_insert(&arena, NULL, 5);
+        assert(!yoink_archive_append(path, 1, (const char *[]){ "bad" }, (void **)pair));
+        struct frozen fhead;
+        fd = open(path, O_RDWR);
+        assert(fd >= 0 && pread(fd, &fhead, sizeof(fhead), 0) == sizeof(fhead));
+        void *wild = (void *)0x1000;
+        off_t slot = (char *)fhead.root - (char *)fhead.base;
+        assert(pwrite(fd, &wild, sizeof(wild), slot) == sizeof(wild));
+        close(fd);
+        ar = yoink_archive_open(path);
+        assert(ar && !yoink_archive_get(ar, "bad"));
+        yoink_archive_close(ar);
+        unlink(path);
+        /* images handed to an arena are vacuumed and yoinked like its own */
+        Arena adopted = ARENA_INIT, other = ARENA_SLAB_INIT;
+        struct node *big = full_tree(&arena, 12);
+        struct node *got = yoink_thaw_into_arena(&adopted, yoink_freeze(big, NULL));
+        assert(arena_contains(&adopted, got) && arena_contains(&adopted, got->left->right));
+        compare_tree(big, got);
+        long abytes, aptrs;
+        arena_stats(&adopted, &abytes, &aptrs);
+        assert(aptrs == 2 * ((1 << 12) - 1));
+        assert(arena_vacuums(&adopted, 1, (void **)&got) == 0);
+        struct node *copied = yoink_to_arena(&other, got);
+        compare_tree(big, copied);
+        assert(arena_vacuums(&adopted, 0, NULL) > 0 && !adopted.slabs);
+        got = yoink_thaw_into_arena(&adopted, yoink_freeze(big, NULL));
+        compare_tree(copied, got);
+        /* marks are cleared after a vacuum, outside the arena too */
+        struct node *across = ARENA_CALLOC(&other, *across);
+        across->left = got;
+        assert(arena_vacuums(&adopted, 1, (void **)&across) == 0);
+        assert(!(yoink_header(across)->flags & YFLAG_IS_USED) &&
+               !(yoink_header(got->right->left)->flags & YFLAG_IS_USED));
+        compare_tree(copied, across->left);
+        /* lazily swept vacuums free what an eager one does, as the arena is
+         * allocated from or stepped through */
+        for (int slab = 0; slab < 2; slab++) {
+                ssize_t freed[2] = { 0, 0 };
+                for (int lazy = 0; lazy < 2; lazy++) {
+                        Arena mixed = ARENA_INIT;
+                        mixed.slab_size = slab ? 1 << 14 : 0;
+                        struct node *keep = NULL;
+                        for (int i = 0; i < 5000; i++) {
+                                keep = bst_insert(&mixed, keep, (i * 7919) % 5000);
+                                for (int j = 0; j < (i / 500 % 2) * 20; j++) {
+                                        struct node *dead = ARENA_CALLOC(&mixed, *dead);
+                                        dead->left = keep;
+                                }
+                                arena_malloc(&mixed, 4000 * (i % 97 == 0));
+                        }
+                        long live = bst_sum(keep);
+                        struct node *outside = ARENA_CALLOC(&other, *outside);
+                        outside->left = keep;
+                        if (!lazy) {
+                                freed[0] = arena_vacuums(&mixed, 1, (void **)&outside);
+                        } else {
+                                arena_vacuums_lazy(&mixed, 1, (void **)&outside);
+                                assert(arena_sweep_pending(&mixed));
+                                assert(!(yoink_header(outside)->flags & YFLAG_IS_USED) &&
+                                       !(yoink_header(keep)->flags & YFLAG_IS_USED));
+                                freed[1] += arena_sweep_step(&mixed, 1000);
+                                for (int i = 0; i < 5000 && arena_sweep_pending(&mixed); i++)
+                                        bst_insert(&mixed, keep, 5000 + i);
+                                while (arena_sweep_pending(&mixed))
+                                        freed[1] += arena_sweep_step(&mixed, 1000);
+                        }
+                        assert(bst_sum(keep) >= live && arena_contains(&mixed, keep));
+                        arena_free(&mixed);
+                }
+                assert(freed[0] > 0 && freed[1] > 0 && freed[1] <= freed[0]);
+        }
+        /* weak pointers are forwarded to what survives and cleared otherwise */
+        for (int mode = 0; mode < 9; mode++) {
+                /* the last vacuums an arena of chains rather than slabs */
+                Arena from = mode == 8 ? (Arena)ARENA_INIT : (Arena)ARENA_SLAB_INIT, to = ARENA_INIT;
+                rb_t queue = RB_BLANK;
+                from.weak_queue = to.weak_queue = &queue;
+                struct node *kept = bst_insert(&from, NULL, 1), *dropped = bst_insert(&from, NULL, 2);
+                struct node *weak = bst_insert(&from, NULL, 3);
+                weak->left = kept;
+                weak->right = dropped;
+                assert(yoink_set_flags(weak, YFLAG_WEAK) == 0);
+                struct node *root = bst_insert(&from, NULL, 4);
+                root->left = weak;
+                root->right = kept;
+                switch (mode) {
+                case 0: case 8: arena_vacuums(&from, 1, (void **)&root); break;
+                case 1:
+                        arena_vacuums_lazy(&from, 1, (void **)&root);
+                        while (arena_sweep_pending(&from))
+                                arena_sweep_step(&from, 1 << 20);
+                        break;
+                case 2: arena_compacts(&from, 1, (void **)&root, NULL); break;
+                case 3: yoinks_to_arena(&to, 1, (void **)&root); break;
+                case 4: yoinks_to_arena_destructive(&to, 1, (void **)&root); break;
+                case 5: yoinks_to_arena_parallel(&to, 1, (void **)&root, 3); break;
+                case 6: yoink_finish(yoink_begin(&to, 1, (void **)&root)); break;
+                case 7: yoinks_to_arena_interned(&to, 1, (void **)&root); break;
+                }
+                weak = root->left;
+                assert(weak->v == 3 && weak->left == root->right && root->right->v == 1 && !weak->right);
+                assert(RB_NITEMS(void *, &queue) == 1 && *(void **)rb_ptr(&queue) == weak);
+                assert(yoink_set_flags(weak, YFLAG_NO_WEAK) == YFLAG_WEAK);
+                rb_free(&queue);
+                arena_free(&from);
+                arena_free(&to);
+        }
+        /* compaction moves survivors into fresh slabs and rewrites pointers to
+         * them, through objects outside the arena too */
+        for (int slab = 0; slab < 2; slab++) {
+                Arena frag = ARENA_INIT;
+                frag.slab_size = slab ? ARENA_SLAB_SIZE : 0;
+                struct node *keep = NULL;
+                for (int i = 0; i < 20000; i++) {
+                        keep = bst_insert(&frag, keep, (i * 7919) % 20000);
+                        for (int j = 0; j < 3; j++) {
+                                struct node *dead = ARENA_CALLOC(&frag, *dead);
+                                dead->left = keep;
+                        }
+                        arena_malloc(&frag, i % 200);
+                }
+                struct node *outside = ARENA_CALLOC(&other, *outside);
+                outside->left = keep->right;
+                long live = bst_sum(keep);
+                void *roots[2] = { keep, outside };
+                struct arena_compact_stats st;
+                ssize_t freed = arena_compacts(&frag, 2, roots, &st);
+                assert(freed > 0 && (size_t)freed == st.freed && st.blocks);
+                assert(st.moved == 20000 * sizeof(struct node));
+                keep = roots[0];
+                assert(roots[1] == outside && outside->left == keep->right);
+                assert(arena_contains(&frag, keep) && bst_sum(keep) == live);
+                assert(arena_nbytes(&frag) == (long)st.moved);
+                assert(arena_compacts(&frag, 1, roots, &st) == 0 && st.moved == 20000 * sizeof(struct node));
+                assert(bst_sum(roots[0]) == live);
+                arena_free(&frag);
+        }
+        /* threads yoinking into the same arena at once */
+        Arena into = ARENA_INIT;
+        struct shared_arg sarg = { &into, full_tree(&arena, 6) };
+        pthread_t yoinkers[4];
+        for (int i = 0; i < 4; i++)
+                assert(!pthread_create(&yoinkers[i], NULL, shared_yoinker, &sarg));
+        for (int i = 0; i < 4; i++)
+                pthread_join(yoinkers[i], NULL);
+        assert(arena_nbytes(&into) == 4 * 200 * 63 * (long)sizeof(struct node));
+        arena_free(&into);
+        arena_free(&adopted);
+        arena_free(&other);
+        arena_free(&arena);
         return 0;
 }
-
-
+#endif
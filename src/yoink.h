@@ -33,30 +33,68 @@
 #include <sys/types.h>
 #include "yoink_private.h"
 #include "arena.h"
+#include "ptrhashtable2.h"
 
 
+/* Copy policy flags, set on individual objects with yoink_set_flags and
+ * honored by every yoink, freeze and vacuum.
+ *
+ * They are useful for data hanging off a structure that can be regenerated,
+ * like a memo cache (YFLAG_NULL_SELF), or large immutable data that outlives
+ * everything yoinked from it, like a symbol table (YFLAG_ALIAS_SELF).
+ *
+ * The root passed to yoink_to_malloc or yoink_freeze is always copied. Aliased
+ * pointers in frozen data are left as is by thaw so are only meaningful in the
+ * process that froze them. Since vacuum never copies, YFLAG_ALIAS_SELF has no
+ * effect on it while the NULL flags clear the fields in place. */
 #define YFLAG_NULL_CHILDREN 1 // do not copy children and instead set all pointers to NULL
 #define YFLAG_NULL_SELF     2 // don't copy self and instead set pointer to NULL when encountered.
 #define YFLAG_ALIAS_SELF    4 // don't copy self and allow pointer to be shared
+#define YFLAG_WEAK        128 // pointers don't keep what they point to, see below
 
 // these allow unsetting flags
 #define YFLAG_NO_NULL_CHILDREN 1 << 8 // do not copy children and instead set all pointers to NULL
 #define YFLAG_NO_NULL_SELF     2 << 8 // don't copy self and instead set pointer to NULL when encountered.
 #define YFLAG_NO_ALIAS_SELF    4 << 8 // don't copy self and allow pointer to be shared
+#define YFLAG_NO_WEAK        128 << 8 // pointers don't keep what they point to
 
 /* internal flags */
 #define YFLAG_IS_FROZEN    8  // set if inside relocatable frozen
 #define YFLAG_IS_USED      16 // utilized by vacuum
 #define YFLAG_ALL_POINTERS 32 // all are pointers
 
-#define YFLAG_F6     64
-#define YFLAG_F7     128
+#define YFLAG_FORWARDED    64 // moved by a destructive yoink, data[0] is the new location
+
+/* Weak objects. The pointers of an object with YFLAG_WEAK are not followed by
+ * yoinks_to_arena, yoinks_to_arena_destructive, yoinks_to_arena_parallel,
+ * yoinks_to_arena_interned, the incremental yoink, arena_vacuums,
+ * arena_vacuums_lazy or arena_compacts, so they keep nothing alive. Once
+ * everything else has been traced each one is forwarded to the copy of what it
+ * points to, left alone if that is kept where it is, or cleared if it was left
+ * behind or is about to be freed. The weak object itself is copied or kept like
+ * any other. Other copies, such as freezing, treat it as an ordinary object.
+ *
+ * If the weak_queue of the arena being yoinked into or vacuumed is set, every
+ * weak object that had a pointer cleared is pushed onto it, so a cache can
+ * evict its dead entries. */
 
 /* allocate some memory in an arena. The new memory will be zero filled.
- * tsz is size of allocation in number of words of size (void*), bptrs is the
- * beginning of the pointers and eptrs is the end of pointers.
+ * tsz is size of allocation in bytes, bptrs is the beginning of the pointers
+ * and eptrs is the end of pointers in number of words of size (void*).
+ * Objects of 2GB or more or with more than 32767 pointers get a wider header,
+ * otherwise there is no limit.
+ *
+ * Memory is only aligned to sizeof(void *). Arenas without slabs happen to
+ * keep malloc's alignment, but objects carved out of a slab, directly or
+ * through an ArenaLocal, sit one after another with 8 byte headers between
+ * them. Don't keep long double, __int128 or vector types that need more in
+ * slab arena objects.
  * alloc is thread-safe and non locking itself but may call malloc. */
-void *arena_yoink_alloc(Arena *arena, int tsz, int bptrs, int eptrs) _MALLOC _MALLOC_SIZE(2);
+void *arena_alloc(Arena *arena, size_t tsz, size_t bptrs, size_t eptrs) _MALLOC _MALLOC_SIZE(2);
+
+/* the same as arena_alloc but allocates from a thread's local buffer, see
+ * ArenaLocal. */
+void *arena_local_alloc(ArenaLocal *local, size_t tsz, size_t bptrs, size_t eptrs) _MALLOC _MALLOC_SIZE(2);
 
 
 /* yoink all data dependencies reachable from root into arena to, all managed
@@ -78,11 +116,92 @@ void *yoink_to_arena(Arena *to, void *root);
  *
  * if always_copy is true then items will be copied even if they already exist
  * in 'target' just like arena_yoink, if it is false, pointers to 'target' will
- * not be copied. there is a cost to setting this to false on the order of the
- * size of target due to having to scan it to classify pointer types.
+ * not be copied. checking whether a pointer is in target is a range lookup in
+ * the arena's block index (see arena_contains) which only has to take in blocks
+ * added since the last yoink, so repeated small yoinks into a large arena cost
+ * what they copy. Many threads may yoink into the same arena at once.
  * */
 ssize_t yoinks_to_arena(Arena *to, int nroots, void *roots[nroots]);
 
+/* A destructive version of yoinks_to_arena for when the source data is going
+ * to be freed right after the yoink. Rather than tracking what has been copied
+ * in a hash table it overwrites the first word of every object it copies with
+ * a forwarding pointer and then scans the copies breadth first, so the cost is
+ * a single pass over the live data.
+ *
+ * After this call the original objects are no longer usable, only free the
+ * arenas they live in. Like yoinks_to_arena, data already in to is left where
+ * it is. Not safe to call while other threads access the source data.
+ * Returns the number of bytes yoinked. */
+ssize_t yoinks_to_arena_destructive(Arena *to, int nroots, void *roots[nroots]);
+
+/* Parallel versions of yoinks_to_arena and yoink_to_malloc that trace and copy
+ * with nthreads threads using work stealing. They produce the same results as
+ * the serial versions although the order objects are laid out in differs.
+ * No more than 64 threads are used however many are asked for.
+ * yoink_to_malloc_parallel returns NULL if the result can't be allocated.
+ *
+ * Copies are claimed by atomically swapping a marker into the first word of a
+ * source object and forwarded through its header, the source is restored
+ * before returning but must not be read or written by other threads during
+ * the call. */
+ssize_t yoinks_to_arena_parallel(Arena *to, int nroots, void *roots[nroots], int nthreads);
+void *yoink_to_malloc_parallel(void *root, size_t *len, int nthreads);
+
+/* Parallel freeze and thaw for large images. yoink_freeze_parallel copies the
+ * graph as above then every thread lays out and fixes up its own blocks of the
+ * copy as independent pieces of one image. It returns a malloced image in the
+ * same format as yoink_freeze, the same size but in a different order, or
+ * NULL if it can't be allocated. yoink_thaw_parallel splits the relocation
+ * bitmap of an image between the threads, images without one are thawed
+ * serially. Neither uses more than 64 threads. */
+struct frozen *yoink_freeze_parallel(void *root, int nthreads);
+void *yoink_thaw_parallel(struct frozen *ice, int nthreads);
+
+/* Hash consing versions of yoinks_to_arena and yoink_to_malloc, objects that
+ * are structurally equal are copied only once and shared. Two objects are
+ * equal when their headers and bytes are the same with pointers compared after
+ * their targets were themselves interned, so equal subtrees collapse to one
+ * copy all the way up. Objects holding a pointer back into a cycle being
+ * copied are never shared but everything else still is.
+ *
+ * Sharing is only found among the objects copied in a single call, data
+ * already in to is left in place as with yoinks_to_arena. Only use on data
+ * that is not mutated afterwards as writing through one shared copy changes
+ * all of them. */
+ssize_t yoinks_to_arena_interned(Arena *to, int nroots, void *roots[nroots]);
+void *yoink_to_malloc_interned(void *root, size_t *len);
+
+/* Incremental yoink, does the same as yoinks_to_arena a bit at a time so the
+ * work can be interleaved with other processing.
+ *
+ * YoinkIncr *inc = yoink_begin(&to, nroots, roots);
+ * while (!yoink_step(inc, 64 * 1024))
+ *         handle_a_request();
+ * yoink_finish(inc);
+ *
+ * yoink_begin copies the roots and yoink_step does around budget bytes more
+ * work, returning true once there is nothing left to copy. Each pointer field
+ * forwarded counts as a word of work on top of the bytes copied, so a step
+ * that only finds copies that already exist still stops in time.
+ * yoink_step_ns works for roughly budget_ns nanoseconds instead. yoink_finish completes the yoink,
+ * updates roots in place, frees the collector state and returns the number of
+ * bytes yoinked.
+ *
+ * Until yoink_finish returns the mutator keeps using the original data, which
+ * the yoink does not change. Any change to an object while the yoink is in
+ * progress must be reported with yoink_touch, or made with yoink_incr_write
+ * which does both, so the copy can be refreshed when finishing. New objects
+ * need no reporting as long as they are stored through the barrier or are
+ * reachable from roots, which is re-read by yoink_finish. Not threadsafe.
+ */
+typedef struct YoinkIncr YoinkIncr;
+YoinkIncr *yoink_begin(Arena *to, int nroots, void *roots[nroots]);
+bool yoink_step(YoinkIncr *inc, size_t budget);
+bool yoink_step_ns(YoinkIncr *inc, long budget_ns);
+void yoink_touch(YoinkIncr *inc, void *obj);
+void yoink_incr_write(YoinkIncr *inc, void *obj, void **slot, void *val);
+ssize_t yoink_finish(YoinkIncr *inc);
 
 /* yoink to a continuous compact buffer that was created via a single malloc
  * call. This always makes a full independent copy of the data.
@@ -92,7 +211,8 @@ ssize_t yoinks_to_arena(Arena *to, int nroots, void *roots[nroots]);
  * free or if you want a more efficient memory/cache layout for long lived
  * data and don't intend to use the arena again.
  *
- * *len will contain the length of data allocated.
+ * *len will contain the length of data allocated. NULL is returned, with *len
+ * set to 0, if the buffer can't be allocated.
  *
  * root must be a valid pointer or NULL.
  *
@@ -100,6 +220,38 @@ ssize_t yoinks_to_arena(Arena *to, int nroots, void *roots[nroots]);
 
 void *yoink_to_malloc(void *root, size_t *len);
 
+/* the exact number of bytes yoink_to_malloc would allocate for root, this
+ * traces the graph without copying anything. */
+size_t yoink_size(void *root);
+
+/* yoink_to_malloc into memory supplied by the caller, such as shared memory
+ * or a buffer registered for I/O, which must be suitably aligned for the
+ * data. Returns the copy of root, which is at the start of buf, or NULL if it
+ * would take more than len bytes, in which case buf is left alone. Nothing is
+ * written outside of the yoink_size(root) bytes at buf. */
+void *yoink_to_buffer(void *root, void *buf, size_t len);
+
+/* the order objects are laid out in by a compacting yoink.
+ *
+ * DFS is depth first preorder with children taken in the order they appear
+ * in their parent, this is what yoink_to_malloc and freeze use and is good for
+ * things walked recursively such as lists and trees.
+ *
+ * BFS is breadth first, putting each level of a tree together.
+ *
+ * CLUSTERED breaks the graph into page sized breadth first subtrees so a
+ * parent is next to its first children, usually in the same cache line, and
+ * a walk down the tree touches few pages.
+ */
+enum yoink_order {
+        YOINK_ORDER_DFS,
+        YOINK_ORDER_BFS,
+        YOINK_ORDER_CLUSTERED,
+};
+
+/* yoink_to_malloc with the objects laid out in the given order. */
+void *yoink_to_malloc_ordered(void *root, size_t *len, enum yoink_order order);
+
 /*
  * This is roughly equivalent to
  *
@@ -129,8 +281,91 @@ void *yoink_to_malloc(void *root, size_t *len);
 
 ssize_t arena_vacuums(Arena *bowl, int nroots, void *roots[nroots]);
 
+/* A vacuum that only marks, leaving the sweep for later so the pause is
+ * proportional to what is live rather than to the size of the arena. Slabs
+ * with nothing live in them and unreachable chains are freed a little at a
+ * time as the arena is allocated from, or by arena_sweep_step which sweeps at
+ * least budget bytes worth of blocks if nobody else is sweeping and returns
+ * the bytes it freed. arena_sweep_pending tells whether anything is left.
+ *
+ * Chains not yet swept are out of the arena, so anything that looks at what is
+ * in it, arena_contains, yoinking into it, joining, vacuuming or freeing it,
+ * finishes the sweep first. Allocation and arena_sweep_step may run on many
+ * threads at once, the vacuum itself is not threadsafe. */
+void arena_vacuums_lazy(Arena *bowl, int nroots, void *roots[nroots]);
+ssize_t arena_sweep_step(Arena *arena, size_t budget);
+bool arena_sweep_pending(Arena *arena);
+
+/* A vacuum that moves what survives. Everything reachable from roots that is
+ * in bowl is copied into fresh slabs of bowl, one after another in the order
+ * it is reached, every pointer to it from the roots and from the objects
+ * traced is rewritten and the old blocks are all freed. Objects outside bowl
+ * stay where they are but are traced, and their pointers into bowl rewritten,
+ * just as vacuum would trace them. Pointers into bowl held anywhere else are
+ * left dangling.
+ *
+ * Returns the number of bytes freed like arena_vacuums and, if stats isn't
+ * NULL, fills it in. Not threadsafe. */
+struct arena_compact_stats {
+        size_t moved;           // bytes of objects copied
+        size_t freed;           // bytes of objects that were not reachable
+        size_t blocks;          // old chains and slabs released
+};
+ssize_t arena_compacts(Arena *bowl, int nroots, void *roots[nroots], struct arena_compact_stats *stats);
+
+/* set and clear the copy policy flags of an object, flags is any of the YFLAG_
+ * and YFLAG_NO_ flags above or'ed together. returns the previous flags. */
 uint32_t yoink_set_flags(void *, uint32_t flags);
 
+/* Generational collection using yoink as a copying collector.
+ *
+ * New objects are allocated in the nursery. A minor collection yoinks whatever
+ * is reachable in the nursery from the roots into the tenured arena and frees
+ * the nursery, anything already tenured is neither copied nor traced so the
+ * cost is proportional to what survived rather than the size of the heap.
+ * Only nursery objects are moved, objects in other arenas or in malloced or
+ * thawed images that the roots reach are traced where they are.
+ *
+ * For this to work tenured objects that are changed to point into the nursery
+ * must be recorded, every store of a pointer into an object that might be
+ * tenured has to go through yoink_write (or YOINK_WRITE) which remembers the
+ * object so its fields are treated as roots by the next minor collection.
+ * Objects passed to yoink_write must have been allocated in an arena.
+ *
+ * The barrier only knows about nursery blocks that have been handed to the
+ * nursery. Don't allocate from the nursery through an ArenaLocal, or detach it
+ * before storing anything it allocated, otherwise a store of such an object
+ * into a tenured one is not remembered and dangles after yoink_minor.
+ *
+ * YoinkGen gen = YOINKGEN_INIT;
+ * struct node *n = ARENA_CALLOC(&gen.nursery, *n);
+ * YOINK_WRITE(&gen, old, left, n);
+ * yoink_minor(&gen, nroots, roots);
+ *
+ * Not threadsafe.
+ */
+typedef struct YoinkGen {
+        Arena nursery;
+        Arena tenured;
+        HashTable remembered;   // objects outside the nursery pointing into it
+} YoinkGen;
+#define YOINKGEN_INIT { .nursery = ARENA_SLAB_INIT, .tenured = ARENA_SLAB_INIT, .remembered = HASHSET_INIT }
+
+/* store val in slot which is a field of obj and remember obj if need be */
+void yoink_write(YoinkGen *gen, void *obj, void **slot, void *val);
+#define YOINK_WRITE(gen, obj, field, val) \
+        yoink_write(gen, obj, (void **)&(obj)->field, val)
+
+/* promote everything reachable from roots or remembered objects into the
+ * tenured arena, roots are updated in place. Returns bytes promoted. */
+ssize_t yoink_minor(YoinkGen *gen, int nroots, void *roots[nroots]);
+
+/* a minor collection followed by vacuuming the tenured arena, returns the
+ * number of bytes freed from the tenured arena. */
+ssize_t yoink_major(YoinkGen *gen, int nroots, void *roots[nroots]);
+
+void yoink_gen_free(YoinkGen *gen);
+
 /* Initialize a buffer for inclusion in an arena. the buffer will be seeded with
  * appropriate bookkeeping data that you should not modify and take into account
  * when looking at rb_len.
@@ -160,6 +395,11 @@ uint32_t yoink_set_flags(void *, uint32_t flags);
         ((char *)&(x)._arena_begin_ptrs - (char *)&(x))/sizeof(void *), \
         ((char *)&(x)._arena_end_ptrs - (char *)&(x))/sizeof(void *))
 
+#define ARENA_LOCAL_CALLOC(local, x) \
+    arena_local_alloc(local, sizeof(x), \
+        ((char *)&(x)._arena_begin_ptrs - (char *)&(x))/sizeof(void *), \
+        ((char *)&(x)._arena_end_ptrs - (char *)&(x))/sizeof(void *))
+
 /* These freeze and thaw data to a pickled version that can be copied
  * around or stored.
  *
@@ -195,9 +435,14 @@ struct frozen {
         uintptr_t length;      // length in bytes including frozen header
         void *base;   // relocation base, contains pointer base, updated by thaw.
         void *root;            // the root
+        uintptr_t relocs;      // offset of the relocation bitmap or 0, objects end here
+        uint32_t crc;          // crc32c of the image as frozen with crc zero
+        uint32_t flags;        // YOINK_FROZEN_CRC if crc is set
         void *data[];
 };
 
+#define YOINK_FROZEN_CRC 1
+
 /**
  * freezes the data to a single contiguous buffer in a machine dependent
  * serializable format.
@@ -209,15 +454,22 @@ struct frozen {
  * performs a yoink under the hood, nothing not pointed to by ptr will be pulled
  * in.
  *
- * ice may be NULL in which case a freshly malloced buffer will be returned,
- * else the data will be written right after ice in memory using no more than
- * ice->length bytes. if it would take more bytes than are available then NULL
- * is returned and the contents of ice are unspecified.
+ * ice may be NULL in which case a freshly malloced buffer of exactly the right
+ * size will be returned, or NULL if it can't be allocated, else ice->length
+ * must be set to the number of bytes available at ice and the frozen data will
+ * be written there, starting with the header. if it would take more bytes than
+ * are available then NULL is returned and ice is left alone.
+ * yoink_frozen_size tells how many bytes are needed.
  *
+ * yoink_freeze checksums the image, yoink_freeze_flags only does if flags has
+ * YOINK_FROZEN_CRC. Leaving it out saves a pass over the image for ones that
+ * never leave the process. yoink_freeze_parallel always checksums.
  *
  * */
 
 struct frozen *yoink_freeze(void *, struct frozen *ice);
+struct frozen *yoink_freeze_flags(void *root, struct frozen *ice, int flags);
+size_t yoink_frozen_size(void *root);
 
 /** This thaws data _in place_. the data will not be associated with an arena but
  * will still reside in *ptr which is still owned by the caller of thaw. It may
@@ -237,5 +489,150 @@ struct frozen *yoink_freeze(void *, struct frozen *ice);
 
 void *yoink_thaw(struct frozen *ice);
 
+/* A thaw for images that can't be trusted, such as files. len is how many
+ * bytes are really there and flags any of
+ *
+ * YOINK_THAW_CRC       the checksum yoink_freeze computes must match, images
+ *                      without one are rejected. An image can only be checked
+ *                      until it has been thawed somewhere else.
+ * YOINK_THAW_BOUNDS    every header must describe an object lying inside the
+ *                      image and every pointer field must be NULL, tagged or
+ *                      point into the objects of the image, so aliased
+ *                      pointers are rejected too.
+ *
+ * Returns the root or NULL, leaving the image alone, if a check fails.
+ * yoink_frozen_crc computes the checksum of an image that yoink_freeze would
+ * have stored. */
+#define YOINK_THAW_CRC    1
+#define YOINK_THAW_BOUNDS 2
+void *yoink_thaw_checked(struct frozen *ice, size_t len, int flags);
+uint32_t yoink_frozen_crc(struct frozen *ice);
+
+/* thaw a malloced image, such as one from yoink_freeze or yoink_thaw_stream,
+ * and hand the buffer over to the arena as one block without copying. The
+ * objects in it become objects of the arena, so they can be yoinked from and
+ * vacuumed, and the buffer is freed once vacuum finds nothing in it live or
+ * the arena is freed. The image itself is gone afterwards, only the returned
+ * root remains. Returns NULL, leaving the image alone, if it was frozen
+ * somewhere else. Mapped images can't be given to an arena. */
+void *yoink_thaw_into_arena(Arena *arena, struct frozen *ice);
+
+/* Streaming versions of freeze and thaw that never hold the whole frozen image
+ * in memory. yoink_freeze_stream writes the same format yoink_freeze makes, a
+ * chunk at a time, through write which behaves like write(2). Returns the
+ * number of bytes written or -1 if write failed. What it keeps in memory is
+ * one entry per object for the layout, not the data.
+ *
+ * yoink_thaw_stream reads a frozen image through read, which behaves like
+ * read(2), thawing objects as they arrive. It returns a malloced image that
+ * is already thawed, so yoink_thaw just returns its root, or NULL if the data
+ * is not a complete frozen image. Object headers are checked to lie within the
+ * image as they arrive, pointer fields are not, so like yoink_thaw it is only
+ * safe on data from a trusted writer.
+ *
+ * The _fd versions do this with a file descriptor, such as a file, pipe or
+ * socket. Only an image written to a seekable descriptor not opened with
+ * O_APPEND carries a checksum, it is written back into the header once the
+ * whole image has been sent. */
+ssize_t yoink_freeze_stream(void *root, ssize_t (*write)(void *arg, const void *buf, size_t len), void *arg);
+struct frozen *yoink_thaw_stream(ssize_t (*read)(void *arg, void *buf, size_t len), void *arg);
+ssize_t yoink_freeze_fd(void *root, int fd);
+struct frozen *yoink_thaw_fd(int fd);
+
+/* Frozen files that are mapped rather than read. yoink_freeze_file writes the
+ * image relocated against an address picked so yoink_thaw_mmap can usually
+ * map the file right there and use it without touching a page, followed by a
+ * page index. When that address is taken the file is mapped elsewhere and
+ * each page is relocated on first touch by a SIGSEGV handler, so only the
+ * pages used are ever read or copied. Pages are let out a couple of megabytes
+ * at a time. Files written another way are mapped and thawed eagerly.
+ *
+ * The kernel doesn't fault on a lazily mapped page for a system call, so
+ * don't hand untouched parts of the image to write(2), send and the like,
+ * they fail with EFAULT. Touch the pages first, or yoink a copy out.
+ *
+ * The mapping is private, changes are never written back to the file. It is
+ * released with yoink_munmap, yoink_thaw of the returned image gives the
+ * root. Returns NULL if the file is not a frozen image. Linux only.
+ */
+ssize_t yoink_freeze_file(void *root, const char *path);
+struct frozen *yoink_thaw_mmap(const char *path);
+void yoink_munmap(struct frozen *ice);
+
+/* A compressed encoding of frozen images for storing and sending them, self
+ * contained and machine dependent like the images themselves. yoink_pack
+ * returns a malloced packed copy of a frozen image, thawed or not, setting
+ * *len to its size, or NULL if it runs out of memory. yoink_unpack unpacks one
+ * with up to nthreads threads, at most one per block and 64 in all, into a
+ * malloced image that is already thawed, or returns NULL if the data isn't a
+ * valid pack. */
+void *yoink_pack(struct frozen *ice, size_t *len);
+struct frozen *yoink_unpack(const void *buf, size_t len, int nthreads);
+
+/* Frozen archives, many roots in one file looked up by key. Each
+ * yoink_archive_append freezes its roots together, so whatever they share is
+ * stored once, and appends them to the archive at path under their keys,
+ * creating it if need be. A key appended again replaces the old entry.
+ * Appends to the same file, from any process, take turns through flock.
+ * Returns 0 or -1 on error.
+ *
+ * yoink_archive_open maps an archive and reads its index, yoink_archive_get
+ * returns the root stored under key, thawing only the roots appended with it
+ * and only the first time, or NULL if there is no such key. Roots stay valid
+ * until yoink_archive_close, changes to them are never written back. Roots
+ * are bounds checked as they are thawed, see YOINK_THAW_BOUNDS, so ones that
+ * held aliased pointers when appended can't be read back.
+ * yoink_archive_count is the number of keys. Lookups are threadsafe.
+ */
+typedef struct YoinkArchive YoinkArchive;
+int yoink_archive_append(const char *path, int n, const char *keys[n], void *roots[n]);
+YoinkArchive *yoink_archive_open(const char *path);
+void *yoink_archive_get(YoinkArchive *ar, const char *key);
+size_t yoink_archive_count(YoinkArchive *ar);
+void yoink_archive_close(YoinkArchive *ar);
+
+/* Delta freezes, for checkpointing a large graph of which only a little changes
+ * between checkpoints.
+ *
+ * YoinkSnap *snap = yoink_snap_new();
+ * deltas[n++] = yoink_freeze_delta(snap, root);   // the base, everything
+ * ...
+ * yoink_snap_write(snap, obj, &obj->next, new);   // or change obj and touch it
+ * deltas[n++] = yoink_freeze_delta(snap, root);   // only what changed
+ * ...
+ * struct frozen *ice = yoink_thaw_deltas(n, deltas);
+ * root = yoink_thaw(ice);
+ *
+ * A delta holds the objects reachable from root that are new since the
+ * previous delta or were reported changed, any change to an object already
+ * frozen, pointer or not, must be reported with yoink_snap_touch or made with
+ * yoink_snap_write. Like yoink_freeze the copy policy flags are honored,
+ * changing the flags of an object counts as changing the objects pointing to
+ * it. Objects tracked by a snapshot may only be freed if their memory is not
+ * reused for another object of the same size before the next delta.
+ *
+ * yoink_thaw_deltas applies the chain from the base on, returning a malloced
+ * frozen image as yoink_freeze would make, or NULL if the deltas don't form a
+ * chain or the image can't be allocated. Objects that became unreachable stay in the image, yoink_snap_reset
+ * makes the next delta a new base that starts a new chain. */
+struct frozen_delta {
+        uintptr_t magic;       // magic number used for sanity checking
+        uintptr_t length;      // length in bytes including this header
+        uintptr_t snapshot;    // the chain this delta belongs to
+        uintptr_t seq;         // position in the chain, 0 for the base
+        uintptr_t image;       // length of the frozen image once applied
+        void *root;            // the root
+        void *data[];
+};
+
+typedef struct YoinkSnap YoinkSnap;
+YoinkSnap *yoink_snap_new(void);
+void yoink_snap_touch(YoinkSnap *snap, void *obj);
+void yoink_snap_write(YoinkSnap *snap, void *obj, void **slot, void *val);
+struct frozen_delta *yoink_freeze_delta(YoinkSnap *snap, void *root);
+void yoink_snap_reset(YoinkSnap *snap);
+void yoink_snap_free(YoinkSnap *snap);
+struct frozen *yoink_thaw_deltas(int n, struct frozen_delta *deltas[n]);
+
 
 #endif /* end of include guard: YOINK_H */
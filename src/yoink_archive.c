@@ -0,0 +1,262 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "yoink.h"
+#include "inthash.h"
+#include "crc32c.h"
+#include "resizable_buf.h"
+
+/* Frozen archives. An archive is a file of segments appended one after
+ * another, each segment is a frozen image whose root is an array of the roots
+ * that were appended together, so they share whatever they have in common,
+ * followed by an index chunk giving the key of each slot of the array. Every
+ * chunk points back to the one before it and the file ends with a trailer
+ * pointing at the last, an append writes its segment over the old trailer and
+ * puts a new one at the end. Appenders hold an exclusive flock on the file
+ * from reading the trailer until the new one is written.
+ *
+ * Opening maps the whole file privately and reads the index chunks from the
+ * newest back so a key appended again shadows its older entries. A lookup
+ * thaws the segment holding the key in place the first time it is wanted,
+ * checking its bounds, only the pages of that segment are written and copied. */
+
+#define ARCHIVE_MAGIC 0xA4C1
+
+struct archive_trailer {
+        uintptr_t magic;        // signature ^ ARCHIVE_MAGIC
+        uint64_t index;         // offset of the last index chunk
+};
+
+struct archive_key {
+        uint64_t at;            // offset of the key from the start of the chunk
+        uint32_t len;
+        uint32_t slot;          // in the root array of the segment
+};
+
+struct archive_index {
+        uintptr_t magic;        // signature ^ ARCHIVE_MAGIC
+        uint64_t prev;          // offset of the chunk before or 0
+        uint64_t image;         // offset of the frozen image of the segment
+        uint64_t nkeys;
+        uint64_t length;        // of the chunk, keys included
+        struct archive_key keys[];
+};
+
+struct entry {
+        const char *key;
+        uint32_t len;
+        uint32_t slot;
+        struct frozen *image;
+};
+
+struct YoinkArchive {
+        char *map;
+        size_t size;
+        HashTable index;        // hash of a key -> entry + 1, probing linearly on collision
+        rb_t entries;
+        pthread_mutex_t lock;   // held while thawing
+};
+
+static uintptr_t
+key_hash(const char *key, size_t len)
+{
+        return hash_uintptr(crc32c(0, key, len) ^ (uintptr_t)len << 32);
+}
+
+static int
+write_at(int fd, const void *buf, size_t len, off_t off)
+{
+        while (len) {
+                ssize_t n = pwrite(fd, buf, len, off);
+                if (n <= 0)
+                        return -1;
+                buf = (const char *)buf + n;
+                off += n;
+                len -= n;
+        }
+        return 0;
+}
+
+static bool
+read_trailer(int fd, size_t size, struct archive_trailer *tr)
+{
+        return size >= sizeof(*tr) && pread(fd, tr, sizeof(*tr), size - sizeof(*tr)) == sizeof(*tr) &&
+               tr->magic == (_yoink_signature() ^ ARCHIVE_MAGIC) && tr->index < size;
+}
+
+int
+yoink_archive_append(const char *path, int n, const char *keys[n], void *roots[n])
+{
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0)
+                return -1;
+        struct stat st;
+        struct archive_trailer tr = { 0 };
+        if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0 || (st.st_size && !read_trailer(fd, st.st_size, &tr))) {
+                close(fd);
+                return -1;
+        }
+        size_t at = st.st_size ? st.st_size - sizeof(tr) : 0;
+        struct archive_trailer old = tr;
+        /* the roots go together in one image through an array */
+        Arena scratch = ARENA_SLAB_INIT;
+        void **array = arena_alloc(&scratch, n * sizeof(void *) + !n, 0, n);
+        memcpy(array, roots, n * sizeof(void *));
+        struct frozen *ice = yoink_freeze(array, NULL);
+        arena_free(&scratch);
+        if (!ice) {
+                close(fd);
+                return -1;
+        }
+        rb_t chunk = RB_BLANK;
+        rb_calloc(&chunk, sizeof(struct archive_index) + n * sizeof(struct archive_key));
+        for (int i = 0; i < n; i++) {
+                struct archive_key *k = (struct archive_key *)((struct archive_index *)rb_ptr(&chunk))->keys + i;
+                k->at = rb_len(&chunk);
+                k->len = strlen(keys[i]);
+                k->slot = i;
+                rb_append(&chunk, keys[i], k->len);
+        }
+        rb_calloc(&chunk, -rb_len(&chunk) & (sizeof(uint64_t) - 1));
+        struct archive_index *ix = rb_ptr(&chunk);
+        ix->magic = _yoink_signature() ^ ARCHIVE_MAGIC;
+        ix->prev = tr.index;
+        ix->image = at;
+        ix->nkeys = n;
+        ix->length = rb_len(&chunk);
+        tr = (struct archive_trailer) { _yoink_signature() ^ ARCHIVE_MAGIC, at + ice->length };
+        int ret = write_at(fd, ice, ice->length, at) < 0 ||
+                  write_at(fd, ix, ix->length, tr.index) < 0 ||
+                  write_at(fd, &tr, sizeof(tr), tr.index + ix->length) < 0 ? -1 : 0;
+        /* put the file back as it was so the archive stays readable */
+        if (ret < 0 && (ftruncate(fd, st.st_size) < 0 ||
+                        (st.st_size && write_at(fd, &old, sizeof(old), at) < 0)))
+                ret = -1;
+        free(ice);
+        rb_free(&chunk);
+        /* closing releases the lock */
+        if (close(fd) < 0)
+                ret = -1;
+        return ret;
+}
+
+/* add the keys of a chunk that aren't shadowed by later ones */
+static bool
+archive_chunk(YoinkArchive *ar, struct archive_index *ix)
+{
+        char *base = (char *)ix;
+        if (ix->image % sizeof(uint64_t) || ix->image >= (uint64_t)(base - ar->map) ||
+            ix->nkeys > (ix->length - sizeof(*ix)) / sizeof(struct archive_key))
+                return false;
+        struct frozen *image = (struct frozen *)(ar->map + ix->image);
+        if (image->magic != _yoink_signature() || image->length > (size_t)(base - (char *)image))
+                return false;
+        for (size_t i = 0; i < ix->nkeys; i++) {
+                struct archive_key *k = &ix->keys[i];
+                if (k->at > ix->length || k->len > ix->length - k->at)
+                        return false;
+                const char *key = base + k->at;
+                for (Key h = key_hash(key, k->len);; h++) {
+                        Value *v;
+                        if (ht_ins(&ar->index, h, &v)) {
+                                RB_PUSH(struct entry, &ar->entries) = (struct entry) {
+                                        key, k->len, k->slot, image
+                                };
+                                *v = RB_NITEMS(struct entry, &ar->entries);
+                                break;
+                        }
+                        struct entry *e = (struct entry *)rb_ptr(&ar->entries) + *v - 1;
+                        if (e->len == k->len && !memcmp(e->key, key, k->len))
+                                break;
+                }
+        }
+        return true;
+}
+
+YoinkArchive *
+yoink_archive_open(const char *path)
+{
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return NULL;
+        struct stat st;
+        struct archive_trailer tr;
+        if (fstat(fd, &st) < 0 || !read_trailer(fd, st.st_size, &tr)) {
+                close(fd);
+                return NULL;
+        }
+        YoinkArchive *ar = calloc(1, sizeof(YoinkArchive));
+        ar->size = st.st_size;
+        ar->index = (HashTable)HASHMAP_INIT;
+        ar->entries = (rb_t)RB_BLANK;
+        pthread_mutex_init(&ar->lock, NULL);
+        ar->map = mmap(NULL, ar->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (ar->map == MAP_FAILED) {
+                ar->map = NULL;
+                yoink_archive_close(ar);
+                return NULL;
+        }
+        /* chunks only ever point back so the walk ends */
+        size_t limit = ar->size - sizeof(tr);
+        for (uint64_t at = tr.index; at;) {
+                struct archive_index *ix = (struct archive_index *)(ar->map + at);
+                if (at % sizeof(uint64_t) || at >= limit || limit - at < sizeof(*ix) ||
+                    ix->magic != (_yoink_signature() ^ ARCHIVE_MAGIC) ||
+                    ix->length < sizeof(*ix) || ix->length > limit - at ||
+                    ix->prev >= at || !archive_chunk(ar, ix)) {
+                        yoink_archive_close(ar);
+                        return NULL;
+                }
+                limit = at;
+                at = ix->prev;
+        }
+        return ar;
+}
+
+void *
+yoink_archive_get(YoinkArchive *ar, const char *key)
+{
+        size_t len = strlen(key);
+        for (Key h = key_hash(key, len);; h++) {
+                Value *v = ht_get(&ar->index, h);
+                if (!v)
+                        return NULL;
+                struct entry *e = (struct entry *)rb_ptr(&ar->entries) + *v - 1;
+                if (e->len != len || memcmp(e->key, key, len))
+                        continue;
+                /* segments come from a file so are checked the first time,
+                 * once thawed they are based where they are */
+                pthread_mutex_lock(&ar->lock);
+                int flags = e->image->base == e->image ? 0 : YOINK_THAW_BOUNDS;
+                void **array = yoink_thaw_checked(e->image, ar->map + ar->size - (char *)e->image, flags);
+                pthread_mutex_unlock(&ar->lock);
+                if (!array || e->slot >= _head_nptrs(container_of(array, struct header, data)))
+                        return NULL;
+                return array[e->slot];
+        }
+}
+
+size_t
+yoink_archive_count(YoinkArchive *ar)
+{
+        return RB_NITEMS(struct entry, &ar->entries);
+}
+
+void
+yoink_archive_close(YoinkArchive *ar)
+{
+        if (ar->map)
+                munmap(ar->map, ar->size);
+        ht_free(&ar->index);
+        rb_free(&ar->entries);
+        pthread_mutex_destroy(&ar->lock);
+        free(ar);
+}
@@ -0,0 +1,217 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <assert.h>
+#include <time.h>
+#include "yoink.h"
+#include "yoink_trace.h"
+#include "inthash.h"
+#include "resizable_buf.h"
+
+/* Delta freezes. Every object the snapshot has seen has a place in a frozen
+ * image that only exists logically, the base delta lays out everything the way
+ * yoink_freeze would and later deltas carry the objects that changed, which
+ * keep their place, and the new ones, which are put after the end of the
+ * image. So applying a chain of deltas in order rebuilds an ordinary frozen
+ * image.
+ *
+ * A delta is a struct frozen_delta followed by records, each is the offset in
+ * the image where an object goes followed by the object, header included.
+ * Pointers into the image are stored as the offset of the data with bit 1 set,
+ * managed pointers are aligned and tagged ones have bit 0 set so these can't
+ * be mistaken for either. */
+
+#define DELTA_MAGIC 0x5EBA
+#define IS_OFFSET(v) (((uintptr_t)(v) & 3) == 2)
+
+struct YoinkSnap {
+        HashTable ids;          // object -> offset of its data in the image, size with header
+        HashTable dirty;        // objects changed since the last delta
+        size_t len;             // length of the image
+        uintptr_t snapshot;
+        uintptr_t seq;
+};
+
+struct fixup {
+        size_t at;              // offset of the field in the delta
+        void *p;                // object it points to
+};
+
+static void
+snap_restart(YoinkSnap *snap)
+{
+        static uintptr_t count;
+        ht_free(&snap->ids);
+        ht_free(&snap->dirty);
+        snap->len = sizeof(struct frozen);
+        snap->seq = 0;
+        snap->snapshot = hash_uintptr((uintptr_t)snap ^ hash_uintptr(time(NULL) + ++count));
+}
+
+YoinkSnap *
+yoink_snap_new(void)
+{
+        YoinkSnap *snap = calloc(1, sizeof(YoinkSnap));
+        snap->ids = (HashTable)HASHTABLE_INIT(2);
+        snap->dirty = (HashTable)HASHSET_INIT;
+        snap_restart(snap);
+        return snap;
+}
+
+void
+yoink_snap_reset(YoinkSnap *snap)
+{
+        snap_restart(snap);
+}
+
+void
+yoink_snap_free(YoinkSnap *snap)
+{
+        ht_free(&snap->ids);
+        ht_free(&snap->dirty);
+        free(snap);
+}
+
+void
+yoink_snap_touch(YoinkSnap *snap, void *obj)
+{
+        ht_add(&snap->dirty, (uintptr_t)obj);
+}
+
+void
+yoink_snap_write(YoinkSnap *snap, void *obj, void **slot, void *val)
+{
+        *slot = val;
+        ht_add(&snap->dirty, (uintptr_t)obj);
+}
+
+/* write the record for np to out if it is new or changed, fields that are to
+ * be pointed at the image are queued on fixups and their targets on todo. */
+static void
+delta_visit(YoinkSnap *snap, HashTable *done, rb_t *out, rb_t *todo, rb_t *fixups, void *np)
+{
+        if (!ht_add(done, (uintptr_t)np))
+                return;
+        struct header *head = container_of(np, struct header, data);
+        char *start = _head_start(head);
+        size_t prefix = (char *)head->data - start, size = prefix + _head_tsz(head);
+        Value *v;
+        bool fresh = ht_ins(&snap->ids, (uintptr_t)np, &v);
+        /* the memory of a freed object was reused for a different one */
+        if (!fresh && v[1] != size)
+                fresh = true;
+        if (!fresh && !ht_in(&snap->dirty, (uintptr_t)np))
+                return;
+        if (fresh) {
+                v[0] = snap->len + prefix;
+                v[1] = size;
+                snap->len += size;
+        }
+        RB_PUSH(uintptr_t, out) = v[0] - prefix;
+        size_t data = rb_len(out) + prefix;
+        rb_append(out, start, size);
+        void **ptrs = (void **)((char *)rb_ptr(out) + data) + _head_bptrs(head);
+        size_t nptrs = _head_nptrs(head);
+        if (head->flags & YFLAG_NULL_CHILDREN) {
+                memset(ptrs, 0, nptrs * sizeof(void *));
+                return;
+        }
+        for (size_t i = 0; i < nptrs; i++) {
+                if (!_yoink_follow(&ptrs[i]))
+                        continue;
+                RB_PUSH(void *, todo) = ptrs[i];
+                RB_PUSH(struct fixup, fixups) = (struct fixup) {
+                        (char *)&ptrs[i] - (char *)rb_ptr(out), ptrs[i]
+                };
+        }
+}
+
+struct frozen_delta *
+yoink_freeze_delta(YoinkSnap *snap, void *root)
+{
+        rb_t out = RB_BLANK, todo = RB_BLANK, fixups = RB_BLANK;
+        HashTable done = HASHSET_INIT;
+        rb_calloc(&out, sizeof(struct frozen_delta));
+        /* everything new is reachable from the root or a changed object */
+        uintptr_t index = 0;
+        Value *v;
+        for (Key k = ht_next(&snap->dirty, &index, &v); index; k = ht_next(&snap->dirty, &index, &v))
+                if (ht_get(&snap->ids, k))
+                        RB_PUSH(void *, &todo) = (void *)k;
+        if (!IS_RAW(root))
+                RB_PUSH(void *, &todo) = root;
+        for (void *np; (np = RB_MPOP(void *, &todo, NULL));)
+                delta_visit(snap, &done, &out, &todo, &fixups, np);
+        RB_FOR(struct fixup, f, &fixups)
+                *(uintptr_t *)((char *)rb_ptr(&out) + f->at) = *ht_get(&snap->ids, (uintptr_t)f->p) | 2;
+        struct frozen_delta *d = rb_ptr(&out);
+        d->magic = _yoink_signature() ^ DELTA_MAGIC;
+        d->length = rb_len(&out);
+        d->snapshot = snap->snapshot;
+        d->seq = snap->seq++;
+        d->image = snap->len;
+        d->root = IS_RAW(root) ? root : (void *)(*ht_get(&snap->ids, (uintptr_t)root) | 2);
+        ht_free(&snap->dirty);
+        ht_free(&done);
+        rb_free(&todo);
+        rb_free(&fixups);
+        return rb_take(&out);
+}
+
+/* the image offset encoded in v if it is in the image */
+static bool
+delta_offset(uintptr_t v, size_t image, size_t *off)
+{
+        *off = v & ~(uintptr_t)3;
+        return IS_OFFSET(v) && *off >= sizeof(struct frozen) && *off < image;
+}
+
+struct frozen *
+yoink_thaw_deltas(int n, struct frozen_delta *deltas[n])
+{
+        if (n < 1 || deltas[0]->image < sizeof(struct frozen))
+                return NULL;
+        size_t image = 0;
+        for (int i = 0; i < n; i++) {
+                struct frozen_delta *d = deltas[i];
+                if (d->magic != (_yoink_signature() ^ DELTA_MAGIC) || d->seq != i ||
+                    d->snapshot != deltas[0]->snapshot || d->image < image ||
+                    d->length < sizeof(struct frozen_delta))
+                        return NULL;
+                image = d->image;
+        }
+        struct frozen *fz = calloc(1, image);
+        if (!fz)
+                return NULL;
+        for (int i = 0; i < n; i++) {
+                char *p = (char *)deltas[i]->data, *end = (char *)deltas[i] + deltas[i]->length;
+                while (p + sizeof(uintptr_t) + sizeof(struct header) <= end) {
+                        uintptr_t at = *(uintptr_t *)p;
+                        p += sizeof(uintptr_t);
+                        char *next = _head_next(_head_at(p));
+                        if (next > end || at < sizeof(struct frozen) || at + (next - p) > image) {
+                                free(fz);
+                                return NULL;
+                        }
+                        memcpy((char *)fz + at, p, next - p);
+                        p = next;
+                }
+        }
+        /* the image is now complete, point it at itself */
+        size_t off;
+        for (char *p = (char *)fz->data; p < (char *)fz + image; ) {
+                struct header *head = _head_at(p);
+                p = _head_next(head);
+                void **ptrs = head->data + _head_bptrs(head);
+                for (size_t i = 0; i < _head_nptrs(head); i++)
+                        if (delta_offset((uintptr_t)ptrs[i], image, &off))
+                                ptrs[i] = (char *)fz + off;
+        }
+        struct frozen_delta *last = deltas[n - 1];
+        fz->root = last->root;
+        if (delta_offset((uintptr_t)last->root, image, &off))
+                fz->root = (char *)fz + off;
+        fz->magic = _yoink_signature();
+        fz->length = image;
+        fz->base = fz;
+        return fz;
+}
@@ -0,0 +1,79 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <assert.h>
+#include "yoink.h"
+#include "resizable_buf.h"
+
+/* Generational collection, a minor collection is a destructive yoink of
+ * whatever the roots and the remembered set reach in the nursery into the
+ * tenured arena, after which the nursery is freed. Only nursery objects are
+ * moved. Anything already in the tenured arena is left alone, the remembered
+ * set stands in for its pointers into the nursery, so the cost is that of the
+ * survivors. Objects anywhere else are traced in place. */
+
+/* the nursery index is only brought up to date when a block was added to it,
+ * otherwise the barrier is a lookup. nothing else refreshes the nursery so
+ * the index can be read after it is released. */
+static bool
+in_nursery(YoinkGen *gen, void *p)
+{
+        if (_arena_index_stale(&gen->nursery)) {
+                _arena_index_refresh(&gen->nursery);
+                _arena_index_release(&gen->nursery);
+        }
+        return _arena_index_find(&gen->nursery, p);
+}
+
+void
+yoink_write(YoinkGen *gen, void *obj, void **slot, void *val)
+{
+        *slot = val;
+        if (IS_RAW(val) || !in_nursery(gen, val))
+                return;
+        if (!in_nursery(gen, obj))
+                ht_add(&gen->remembered, (uintptr_t)obj);
+}
+
+ssize_t
+yoink_minor(YoinkGen *gen, int nroots, void *root[nroots])
+{
+        /* the pointer fields of remembered objects are roots too */
+        rb_t roots = RB_BLANK;
+        rb_append(&roots, root, nroots * sizeof(void *));
+        uintptr_t index = 0;
+        Value *v;
+        for (Key k = ht_next(&gen->remembered, &index, &v); index; k = ht_next(&gen->remembered, &index, &v)) {
+                struct header *head = container_of((void *)k, struct header, data);
+                rb_append(&roots, head->data + _head_bptrs(head), _head_nptrs(head) * sizeof(void *));
+        }
+        void **rs = rb_ptr(&roots);
+        ssize_t tlen = _yoinks_to_arena_from(&gen->tenured, &gen->nursery, &gen->tenured,
+                                             RB_NITEMS(void *, &roots), rs);
+        memcpy(root, rs, nroots * sizeof(void *));
+        rs += nroots;
+        index = 0;
+        for (Key k = ht_next(&gen->remembered, &index, &v); index; k = ht_next(&gen->remembered, &index, &v)) {
+                struct header *head = container_of((void *)k, struct header, data);
+                memcpy(head->data + _head_bptrs(head), rs, _head_nptrs(head) * sizeof(void *));
+                rs += _head_nptrs(head);
+        }
+        rb_free(&roots);
+        ht_free(&gen->remembered);
+        arena_free(&gen->nursery);
+        return tlen;
+}
+
+ssize_t
+yoink_major(YoinkGen *gen, int nroots, void *root[nroots])
+{
+        yoink_minor(gen, nroots, root);
+        return arena_vacuums(&gen->tenured, nroots, root);
+}
+
+void
+yoink_gen_free(YoinkGen *gen)
+{
+        ht_free(&gen->remembered);
+        arena_free(&gen->nursery);
+        arena_free(&gen->tenured);
+}
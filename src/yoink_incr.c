@@ -0,0 +1,153 @@
+#include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
+#include <assert.h>
+#include <time.h>
+#include "yoink.h"
+#include "yoink_trace.h"
+#include "resizable_buf.h"
+
+/* Incremental yoink, this is yoinks_to_arena cut into pieces. The forwarding
+ * table and the stack of copied pointer fields still to be forwarded persist
+ * between steps. The source is never modified so the mutator keeps using it
+ * until the end, objects it changes after they were copied are recorded by the
+ * barrier and copied again when the yoink is finished. */
+
+struct YoinkIncr {
+        Arena *to;
+        int nroots;
+        void **roots;
+        HashTable ht;           // source object -> copy
+        HashTable dirty;        // copied objects changed since
+        rb_t stack;             // fields of copies that need forwarding
+        rb_t weak;              // copies of weak objects, fixed up at the end
+        ssize_t tlen;
+};
+
+/* returns what p should be replaced with in the copy */
+static void *
+incr_forward(YoinkIncr *inc, void *p)
+{
+        if (!_yoink_follow(&p) || _arena_index_find(inc->to, p))
+                return p;
+        uintptr_t *pp = NULL;
+        if (ht_ins(&inc->ht, (uintptr_t)p, &pp)) {
+                struct header *head = container_of(p, struct header, data);
+                struct header *nhead = _arena_clone_header(inc->to, head);
+                memcpy(nhead->data, head->data, _head_tsz(head));
+                inc->tlen += _head_tsz(head);
+                if (_yoink_null_children(nhead))
+                        ;
+                else if (nhead->flags & YFLAG_WEAK)
+                        RB_PUSH(struct header *, &inc->weak) = nhead;
+                else
+                        for (size_t i = 0; i < _head_nptrs(nhead); i++)
+                                RB_PUSH(void **, &inc->stack) = &nhead->data[_head_bptrs(nhead) + i];
+                *pp = (uintptr_t)nhead->data;
+        }
+        return (void *)*pp;
+}
+
+YoinkIncr *
+yoink_begin(Arena *to, int nroots, void *root[nroots])
+{
+        YoinkIncr *inc = calloc(1, sizeof(*inc));
+        inc->to = to;
+        inc->nroots = nroots;
+        inc->roots = root;
+        inc->ht = (HashTable)HASHMAP_INIT;
+        inc->dirty = (HashTable)HASHSET_INIT;
+        inc->stack = (rb_t)RB_BLANK;
+        inc->weak = (rb_t)RB_BLANK;
+        _arena_index_refresh(to);
+        for (int i = 0; i < nroots; i++)
+                incr_forward(inc, root[i]);
+        return inc;
+}
+
+bool
+yoink_step(YoinkIncr *inc, size_t budget)
+{
+        /* every field popped is charged, not only the bytes copied, so
+         * forwarding to copies that already exist isn't free */
+        ssize_t left = budget > SSIZE_MAX ? SSIZE_MAX : budget;
+        while (rb_len(&inc->stack) && left > 0) {
+                void **slot = RB_MPOP(void **, &inc->stack, NULL);
+                ssize_t tlen = inc->tlen;
+                *slot = incr_forward(inc, *slot);
+                left -= sizeof(void *) + (inc->tlen - tlen);
+        }
+        return !rb_len(&inc->stack);
+}
+
+static long
+now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+bool
+yoink_step_ns(YoinkIncr *inc, long budget_ns)
+{
+        long stop = now_ns() + budget_ns;
+        /* check the clock every few kilobytes of work rather than for each
+         * field */
+        while (!yoink_step(inc, 1 << 12))
+                if (now_ns() >= stop)
+                        return false;
+        return true;
+}
+
+void
+yoink_touch(YoinkIncr *inc, void *obj)
+{
+        if (ht_get(&inc->ht, (uintptr_t)obj))
+                ht_add(&inc->dirty, (uintptr_t)obj);
+}
+
+void
+yoink_incr_write(YoinkIncr *inc, void *obj, void **slot, void *val)
+{
+        *slot = val;
+        yoink_touch(inc, obj);
+}
+
+ssize_t
+yoink_finish(YoinkIncr *inc)
+{
+        /* fields queued before the copies are refreshed must be forwarded
+         * first, refreshing pushes them again with source pointers */
+        while (rb_len(&inc->stack)) {
+                void **slot = RB_MPOP(void **, &inc->stack, NULL);
+                *slot = incr_forward(inc, *slot);
+        }
+        /* bring copies of changed objects up to date and trace them again */
+        uintptr_t index = 0;
+        Value *v;
+        for (Key k = ht_next(&inc->dirty, &index, &v); index; k = ht_next(&inc->dirty, &index, &v)) {
+                struct header *head = container_of((void *)k, struct header, data);
+                struct header *nhead = container_of((void *)*ht_get(&inc->ht, k), struct header, data);
+                memcpy(nhead->data, head->data, _head_tsz(head));
+                /* weak copies are already on the weak list */
+                if (!_yoink_null_children(nhead) && !(nhead->flags & YFLAG_WEAK))
+                        for (size_t i = 0; i < _head_nptrs(nhead); i++)
+                                RB_PUSH(void **, &inc->stack) = &nhead->data[_head_bptrs(nhead) + i];
+        }
+        for (int i = 0; i < inc->nroots; i++)
+                inc->roots[i] = incr_forward(inc, inc->roots[i]);
+        while (rb_len(&inc->stack)) {
+                void **slot = RB_MPOP(void **, &inc->stack, NULL);
+                *slot = incr_forward(inc, *slot);
+        }
+        _yoink_weak_fixup(inc->to, &inc->weak, _yoink_resolve, &(struct _yoink_weak) { inc->to, &inc->ht });
+        _arena_index_release(inc->to);
+        ssize_t tlen = inc->tlen;
+        ht_free(&inc->ht);
+        ht_free(&inc->dirty);
+        rb_free(&inc->stack);
+        rb_free(&inc->weak);
+        free(inc);
+        return tlen;
+}
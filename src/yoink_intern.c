@@ -0,0 +1,213 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include "yoink.h"
+#include "yoink_trace.h"
+#include "inthash.h"
+#include "resizable_buf.h"
+
+/* Hash consing yoink, objects are copied in post order so that by the time an
+ * object is copied all its children already have their final copies, two
+ * objects are then equal when their headers and bytes are equal with the
+ * children compared by identity. Each candidate copy is built in a scratch
+ * buffer and only allocated in the destination if no equal copy was made
+ * before.
+ *
+ * A pointer to an object whose copy is still in progress is a back edge of a
+ * cycle, an object holding one can't be compared as its contents are not
+ * known yet so it is copied as is and the field fixed up at the end. Only
+ * those objects miss out on sharing, their ancestors are still interned. */
+
+struct frame {
+        struct header *head;
+        size_t next;            // next pointer field to visit
+};
+
+struct fixup {
+        void **slot;
+        void *orig;
+};
+
+struct intern {
+        Arena *to;
+        HashTable ht;           // source object -> copy, 0 while in progress
+        HashTable interned;     // hash of a copy -> copy, probing linearly on collision
+        rb_t stack;
+        rb_t scratch;
+        rb_t fixups;
+        rb_t weak;              // copies of weak objects, fixed up at the end
+        bool honour_weak;       // copies for yoink_to_malloc_interned don't
+        ssize_t tlen;
+};
+
+static uintptr_t
+intern_hash(struct header *head)
+{
+        size_t tsz = _head_tsz(head);
+        uintptr_t h = hash_uintptr(tsz);
+        h = hash_uintptr(h ^ _head_nptrs(head));
+        h = hash_uintptr(h ^ (_head_bptrs(head) << 8 | (uint8_t)head->flags));
+        /* sizes are always a whole number of words */
+        for (size_t i = 0; i < tsz / sizeof(void *); i++)
+                h = hash_uintptr(h ^ (uintptr_t)head->data[i]);
+        return h;
+}
+
+static struct header *
+intern_alloc(struct intern *in, struct header *cand)
+{
+        struct header *nhead = _arena_clone_header(in->to, cand);
+        memcpy(nhead->data, cand->data, _head_tsz(cand));
+        in->tlen += _head_tsz(cand);
+        return nhead;
+}
+
+/* return an existing copy equal to cand or make a new one */
+static struct header *
+intern_find(struct intern *in, struct header *cand)
+{
+        for (Key k = intern_hash(cand);; k++) {
+                Value *v;
+                if (ht_ins(&in->interned, k, &v)) {
+                        struct header *nhead = intern_alloc(in, cand);
+                        *v = (Value)nhead;
+                        return nhead;
+                }
+                struct header *nhead = (struct header *)*v;
+                if (_head_tsz(nhead) == _head_tsz(cand) && _head_nptrs(nhead) == _head_nptrs(cand) &&
+                    _head_bptrs(nhead) == _head_bptrs(cand) && nhead->flags == cand->flags &&
+                    !memcmp(nhead->data, cand->data, _head_tsz(cand)))
+                        return nhead;
+        }
+}
+
+/* whether the pointers of head are left for the weak fixup */
+static bool
+intern_weak(struct intern *in, struct header *head)
+{
+        return in->honour_weak && head->flags & YFLAG_WEAK;
+}
+
+/* copy the object on top of the stack now that its children are done */
+static void
+intern_finish(struct intern *in, struct header *head)
+{
+        /* the wide prefix, if any, comes along */
+        size_t prefix = (char *)head->data - (char *)_head_start(head);
+        size_t bptrs = _head_bptrs(head), nptrs = _head_nptrs(head);
+        rb_clear(&in->scratch);
+        rb_append(&in->scratch, _head_start(head), prefix + _head_tsz(head));
+        struct header *cand = _head_at(rb_ptr(&in->scratch));
+        size_t nfix = RB_NITEMS(struct fixup, &in->fixups);
+        bool weak = intern_weak(in, cand);
+        if (!_yoink_null_children(cand) && !weak) {
+                for (size_t i = 0; i < nptrs; i++) {
+                        void **slot = &cand->data[bptrs + i];
+                        if (!_yoink_follow(slot) || _arena_index_find(in->to, *slot))
+                                continue;
+                        void *c = (void *)*ht_get(&in->ht, (uintptr_t)*slot);
+                        if (!c)
+                                RB_PUSH(struct fixup, &in->fixups) =
+                                        (struct fixup) { (void **)(uintptr_t)(bptrs + i), *slot };
+                        *slot = c;
+                }
+        }
+        struct header *nhead;
+        if (weak) {
+                /* what it points to is only known at the end so it isn't
+                 * shared */
+                nhead = intern_alloc(in, cand);
+                if (!_yoink_null_children(nhead))
+                        RB_PUSH(struct header *, &in->weak) = nhead;
+        } else if (nfix == RB_NITEMS(struct fixup, &in->fixups)) {
+                nhead = intern_find(in, cand);
+        } else {
+                nhead = intern_alloc(in, cand);
+                /* fixups recorded the field index, make them real slots */
+                RB_FOR(struct fixup, f, &in->fixups)
+                        if (f - (struct fixup *)rb_ptr(&in->fixups) >= nfix)
+                                f->slot = &nhead->data[(uintptr_t)f->slot];
+        }
+        *ht_get(&in->ht, (uintptr_t)head->data) = (Value)nhead->data;
+}
+
+static void
+intern_push(struct intern *in, void *p)
+{
+        Value *v;
+        if (ht_ins(&in->ht, (uintptr_t)p, &v)) {
+                *v = 0;
+                RB_PUSH(struct frame, &in->stack) =
+                        (struct frame) { container_of(p, struct header, data), 0 };
+        }
+}
+
+static ssize_t
+intern_yoink(Arena *to, int nroots, void *root[nroots], bool honour_weak)
+{
+        struct intern in = { .to = to, .ht = HASHMAP_INIT, .interned = HASHMAP_INIT,
+                             .stack = RB_BLANK, .scratch = RB_BLANK, .fixups = RB_BLANK,
+                             .weak = RB_BLANK, .honour_weak = honour_weak };
+        _arena_index_refresh(to);
+        for (int i = 0; i < nroots; i++) {
+                if (!_yoink_follow(&root[i]) || _arena_index_find(to, root[i]))
+                        continue;
+                intern_push(&in, root[i]);
+                while (rb_len(&in.stack)) {
+                        struct frame *f = (struct frame *)rb_endptr(&in.stack) - 1;
+                        struct header *head = f->head;
+                        if (f->next < _head_nptrs(head) && !(head->flags & YFLAG_NULL_CHILDREN) &&
+                            !intern_weak(&in, head)) {
+                                void *c = head->data[_head_bptrs(head) + f->next++];
+                                if (_yoink_follow(&c) && !_arena_index_find(to, c))
+                                        intern_push(&in, c);
+                                continue;
+                        }
+                        RB_MPOP(struct frame, &in.stack, (struct frame) { 0 });
+                        intern_finish(&in, head);
+                }
+        }
+        RB_FOR(struct fixup, f, &in.fixups)
+                *f->slot = (void *)*ht_get(&in.ht, (uintptr_t)f->orig);
+        for (int i = 0; i < nroots; i++) {
+                Value *v = root[i] ? ht_get(&in.ht, (uintptr_t)root[i]) : NULL;
+                if (v)
+                        root[i] = (void *)*v;
+        }
+        _yoink_weak_fixup(to, &in.weak, _yoink_resolve, &(struct _yoink_weak) { to, &in.ht });
+        _arena_index_release(to);
+        ht_free(&in.ht);
+        ht_free(&in.interned);
+        rb_free(&in.stack);
+        rb_free(&in.scratch);
+        rb_free(&in.fixups);
+        rb_free(&in.weak);
+        return in.tlen;
+}
+
+ssize_t
+yoinks_to_arena_interned(Arena *to, int nroots, void *root[nroots])
+{
+        return intern_yoink(to, nroots, root, true);
+}
+
+void *
+yoink_to_malloc_interned(void *root, size_t *len)
+{
+        /* intern into a scratch arena then lay that out, yoink_to_malloc
+         * keeps the sharing */
+        Arena scratch = ARENA_SLAB_INIT;
+        void *copy = root;
+        if (!IS_RAW(root)) {
+                /* the root is always copied whatever its flags say */
+                struct header *rhead = container_of(root, struct header, data);
+                uint8_t rflags = rhead->flags;
+                rhead->flags &= ~(YFLAG_NULL_SELF | YFLAG_ALIAS_SELF);
+                intern_yoink(&scratch, 1, &copy, false);
+                rhead->flags = rflags;
+        }
+        void *ret = yoink_to_malloc(copy, len);
+        arena_free(&scratch);
+        return ret;
+}
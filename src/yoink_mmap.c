@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "yoink.h"
+
+/* Mapping frozen files. The file is first mapped privately at the base it was
+ * relocated against, when that works the image is ready as is. Otherwise the
+ * image is served out of a memfd mapped twice, the view handed out starts
+ * inaccessible and the first touch of a page faults into lazy_fault which
+ * reads the pages around it from the file into the other view, relocates the
+ * pointers in them and only then opens them up. Other threads touching them
+ * in the meantime fault too and wait, so nobody ever sees an unrelocated
+ * pointer.
+ *
+ * Pages are let out in granules of at least LAZY_GRANULE bytes, and fewer than
+ * LAZY_GRANULES of them however large the image. Every run of open pages
+ * between closed ones is a mapping of its own to the kernel, so opening single
+ * pages of a large image scattered about would run into vm.max_map_count.
+ *
+ * Which words of a page are pointers depends on the objects overlapping it,
+ * the page index written by yoink_freeze_file gives the object covering the
+ * start of each page so a page can be done without looking at the rest of
+ * the image. */
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* lazily mapped images live at the same time */
+#define LAZY_MAX 64
+#define LAZY_GRANULE (2 << 20)
+#define LAZY_GRANULES 8192
+
+enum { PAGE_UNTOUCHED, PAGE_BUSY, PAGE_DONE };
+
+struct lazy {
+        char *user;             // the view handed out
+        char *work;             // where pages are relocated before being let out
+        size_t maplen;
+        size_t length;          // of the image
+        size_t objs;            // where the objects end
+        size_t psz;
+        size_t gsz;             // bytes let out at once
+        uintptr_t base;         // the image was relocated against
+        int fd;
+        uint64_t *index;        // the file's page index
+        size_t nindex;
+        _Atomic uint8_t *state; // per granule
+};
+
+static struct lazy *_Atomic lazies[LAZY_MAX];
+static struct sigaction old_segv;
+static pthread_once_t segv_once = PTHREAD_ONCE_INIT;
+
+/* read all of len at off or zero fill what is past the end of the file */
+static void
+read_at(int fd, void *buf, size_t len, size_t off)
+{
+        while (len) {
+                ssize_t n = pread(fd, buf, len, off);
+                if (n <= 0) {
+                        memset(buf, 0, len);
+                        return;
+                }
+                buf = (char *)buf + n;
+                off += n;
+                len -= n;
+        }
+}
+
+static struct lazy *
+lazy_find(char *addr)
+{
+        for (int i = 0; i < LAZY_MAX; i++) {
+                struct lazy *lz = lazies[i];
+                if (lz && addr >= lz->user && addr < lz->user + lz->maplen)
+                        return lz;
+        }
+        return NULL;
+}
+
+/* relocate the pointers of a page into the work view, the objects overlapping
+ * it are walked from the one the index says covers its start, headers before
+ * the page are read from the file. */
+static void
+lazy_relocate(struct lazy *lz, size_t page)
+{
+        size_t off = page * lz->psz;
+        size_t end = off + lz->psz < lz->length ? off + lz->psz : lz->length;
+        ptrdiff_t offset = (uintptr_t)lz->user - lz->base;
+        read_at(lz->fd, lz->work + off, end - off, off);
+        size_t pos = off / _YOINK_PAGE < lz->nindex ? lz->index[off / _YOINK_PAGE] : lz->length;
+        char hb[sizeof(struct wide) + sizeof(struct header)];
+        while (pos < lz->objs && pos + sizeof(struct header) <= end) {
+                char *p = lz->work + pos;
+                if (pos < off || pos + sizeof(hb) > end) {
+                        read_at(lz->fd, hb, sizeof(hb), pos);
+                        p = hb;
+                }
+                struct header *head = _head_at(p);
+                size_t data = pos + ((char *)head->data - p);
+                size_t ps = data + _head_bptrs(head) * sizeof(void *);
+                size_t pe = ps + _head_nptrs(head) * sizeof(void *);
+                for (size_t f = ps < off ? off : ps; f < pe && f < end; f += sizeof(void *)) {
+                        uintptr_t *w = (uintptr_t *)(lz->work + f);
+                        if (!(*w & 1) && *w - lz->base < lz->length)
+                                *w += offset;
+                }
+                pos = data + _head_tsz(head);
+        }
+        if (off == 0) {
+                struct frozen *fz = (struct frozen *)lz->work;
+                if (!((uintptr_t)fz->root & 1) && (uintptr_t)fz->root - lz->base < lz->length)
+                        fz->root = (char *)fz->root + offset;
+                fz->flags &= ~YOINK_FROZEN_CRC;
+                fz->base = lz->user;
+        }
+}
+
+static void
+lazy_fault(int sig, siginfo_t *si, void *uctx)
+{
+        struct lazy *lz = lazy_find(si->si_addr);
+        if (!lz) {
+                /* not ours, hand it on. returning with the default action
+                 * restored faults again and takes it. */
+                if (old_segv.sa_flags & SA_SIGINFO)
+                        old_segv.sa_sigaction(sig, si, uctx);
+                else if (old_segv.sa_handler != SIG_DFL && old_segv.sa_handler != SIG_IGN)
+                        old_segv.sa_handler(sig);
+                else
+                        signal(sig, SIG_DFL);
+                return;
+        }
+        size_t g = ((char *)si->si_addr - lz->user) / lz->gsz;
+        uint8_t expect = PAGE_UNTOUCHED;
+        if (atomic_compare_exchange_strong(&lz->state[g], &expect, PAGE_BUSY)) {
+                size_t off = g * lz->gsz;
+                size_t len = lz->maplen - off < lz->gsz ? lz->maplen - off : lz->gsz;
+                for (size_t page = off / lz->psz; page < (off + len) / lz->psz; page++)
+                        lazy_relocate(lz, page);
+                if (mprotect(lz->user + off, len, PROT_READ | PROT_WRITE) < 0) {
+                        /* the page can't be let out and would fault forever */
+                        static const char msg[] = "yoink_thaw_mmap: mprotect failed\n";
+                        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+                        abort();
+                }
+                lz->state[g] = PAGE_DONE;
+        } else {
+                while (lz->state[g] != PAGE_DONE)
+                        sched_yield();
+        }
+}
+
+static void
+segv_install(void)
+{
+        struct sigaction sa = { .sa_sigaction = lazy_fault, .sa_flags = SA_SIGINFO | SA_NODEFER };
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, &old_segv);
+}
+
+static void
+lazy_free(struct lazy *lz)
+{
+        if (lz->user && lz->user != MAP_FAILED)
+                munmap(lz->user, lz->maplen);
+        if (lz->work && lz->work != MAP_FAILED)
+                munmap(lz->work, lz->maplen);
+        close(lz->fd);
+        free(lz->index);
+        free((void *)lz->state);
+        free(lz);
+}
+
+/* the page index of the file or NULL if it has none */
+static uint64_t *
+read_index(int fd, size_t fsize, size_t length, size_t *nindex)
+{
+        struct _yoink_trailer tr;
+        if (fsize < length + sizeof(tr))
+                return NULL;
+        read_at(fd, &tr, sizeof(tr), fsize - sizeof(tr));
+        if (tr.magic != (_yoink_signature() ^ _YOINK_TRAILER_MAGIC) ||
+            tr.npages != (length + _YOINK_PAGE - 1) / _YOINK_PAGE ||
+            fsize != length + tr.npages * sizeof(uint64_t) + sizeof(tr))
+                return NULL;
+        uint64_t *index = malloc(tr.npages * sizeof(uint64_t));
+        if (!index)
+                return NULL;
+        read_at(fd, index, tr.npages * sizeof(uint64_t), length);
+        *nindex = tr.npages;
+        return index;
+}
+
+/* give up on a lazy mapping, leaving the file and index to the caller */
+static struct frozen *
+lazy_abort(struct lazy *lz)
+{
+        lz->fd = -1;
+        lz->index = NULL;
+        lazy_free(lz);
+        return NULL;
+}
+
+/* takes over fd and index if it succeeds */
+static struct frozen *
+map_lazy(int fd, struct frozen *head, size_t psz, size_t maplen, uint64_t *index, size_t nindex)
+{
+        if (psz % _YOINK_PAGE)
+                return NULL;
+        struct lazy *lz = calloc(1, sizeof(struct lazy));
+        if (!lz)
+                return NULL;
+        size_t gsz = LAZY_GRANULE > psz ? LAZY_GRANULE / psz * psz : psz;
+        if (maplen / gsz >= LAZY_GRANULES)
+                gsz = (maplen / LAZY_GRANULES / psz + 1) * psz;
+        *lz = (struct lazy) {
+                .maplen = maplen, .length = head->length,
+                .objs = head->relocs ? head->relocs : head->length, .psz = psz, .gsz = gsz,
+                .base = (uintptr_t)head->base, .fd = fd, .index = index, .nindex = nindex,
+                .state = calloc((maplen + gsz - 1) / gsz, sizeof(uint8_t)),
+        };
+        if (!lz->state)
+                return lazy_abort(lz);
+        int mfd = memfd_create("yoink", MFD_CLOEXEC);
+        if (mfd < 0 || ftruncate(mfd, maplen) < 0) {
+                if (mfd >= 0)
+                        close(mfd);
+                return lazy_abort(lz);
+        }
+        lz->user = mmap(NULL, maplen, PROT_NONE, MAP_SHARED, mfd, 0);
+        lz->work = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+        close(mfd);
+        if (lz->user == MAP_FAILED || lz->work == MAP_FAILED)
+                return lazy_abort(lz);
+        pthread_once(&segv_once, segv_install);
+        for (int i = 0; i < LAZY_MAX; i++) {
+                struct lazy *expect = NULL;
+                if (atomic_compare_exchange_strong(&lazies[i], &expect, lz))
+                        return (struct frozen *)lz->user;
+        }
+        return lazy_abort(lz);
+}
+
+struct frozen *
+yoink_thaw_mmap(const char *path)
+{
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return NULL;
+        struct stat st;
+        struct frozen head;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(head))
+                goto fail;
+        read_at(fd, &head, sizeof(head), 0);
+        if (head.magic != _yoink_signature() || head.length < sizeof(head) ||
+            head.length > (size_t)st.st_size)
+                goto fail;
+        size_t psz = sysconf(_SC_PAGESIZE);
+        size_t maplen = (head.length + psz - 1) / psz * psz;
+        if (!((uintptr_t)head.base % psz)) {
+                void *m = mmap(head.base, maplen, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+                if (m == head.base) {
+                        close(fd);
+                        return m;
+                }
+                /* kernels before 4.17 take the address as a hint */
+                if (m != MAP_FAILED)
+                        munmap(m, maplen);
+        }
+        size_t nindex;
+        uint64_t *index = read_index(fd, st.st_size, head.length, &nindex);
+        if (index) {
+                struct frozen *fz = map_lazy(fd, &head, psz, maplen, index, nindex);
+                if (fz)
+                        return fz;
+                free(index);
+        }
+        struct frozen *fz = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (fz == MAP_FAILED)
+                return NULL;
+        yoink_thaw(fz);
+        return fz;
+fail:
+        close(fd);
+        return NULL;
+}
+
+void
+yoink_munmap(struct frozen *ice)
+{
+        for (int i = 0; i < LAZY_MAX; i++) {
+                struct lazy *lz = lazies[i];
+                if (lz && lz->user == (char *)ice) {
+                        lazies[i] = NULL;
+                        lazy_free(lz);
+                        return;
+                }
+        }
+        size_t psz = sysconf(_SC_PAGESIZE);
+        munmap(ice, (ice->length + psz - 1) / psz * psz);
+}
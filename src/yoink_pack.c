@@ -0,0 +1,507 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "yoink.h"
+#include "inthash.h"
+#include "resizable_buf.h"
+
+/* Packed frozen images. The objects of the image are cut into blocks of about
+ * PACK_BLOCK bytes, each block is first transformed to something that
+ * compresses better and then run through a small LZ codec, blocks don't
+ * depend on each other so they can be unpacked in parallel.
+ *
+ * The transform writes each object as its header followed by its data with the
+ * pointer fields replaced by a varint, the low two bits say what it is:
+ *
+ *      0       NULL
+ *      1       a pointer into the image, the rest is the zigzagged distance
+ *              in words from the field to what it points to
+ *      2       anything else, the word follows as is
+ *      3       a pointer into the image that isn't word aligned, the distance
+ *              is in bytes
+ *
+ * Headers repeat a lot so a header seen before in the block is a single byte
+ * indexing a direct mapped cache of them, others are PACK_RAW followed by the
+ * header, wide prefix included, and go in the cache.
+ *
+ * Unpacking writes the pointers relative to where the image is unpacked to so
+ * it comes out thawed. Whatever follows the objects, the relocation bitmap,
+ * is packed as raw blocks. */
+
+#define PACK_MAGIC 0x9ACC
+#define PACK_BLOCK (256 * 1024)
+#define PACK_CACHE 64
+#define PACK_RAW 0xFF
+
+enum { BLOCK_OBJECTS, BLOCK_RAW };
+
+struct pack_block {
+        uint64_t offset;        // in the image
+        uint64_t length;        // of the image it covers
+        uint64_t at;            // of the compressed data in the pack
+        uint64_t size;          // compressed
+        uint64_t tsize;         // transformed, before compression
+        uint64_t kind;
+};
+
+struct pack {
+        uintptr_t magic;        // signature ^ PACK_MAGIC
+        uint64_t length;        // of the image
+        uint64_t relocs;        // as in the image
+        uint64_t root;          // offset of the root with bit 1 set or the raw root
+        uint64_t nblocks;
+        struct pack_block blocks[];
+};
+
+/* LZ block codec. A sequence is a token byte with the literal count in the
+ * high nibble and the match length less LZ_MIN in the low one, either being
+ * 15 continues in following bytes that add up until one is below 255. Then
+ * come the literals and a two byte little endian distance back to the match.
+ * The last sequence has only literals. */
+
+#define LZ_MIN 4
+#define LZ_HASH_BITS 14
+
+static void
+lz_length(rb_t *out, size_t n)
+{
+        for (; n >= 255; n -= 255)
+                RB_PUSH(uint8_t, out) = 255;
+        RB_PUSH(uint8_t, out) = n;
+}
+
+static void
+lz_sequence(rb_t *out, const uint8_t *lit, size_t nlit, size_t dist, size_t mlen)
+{
+        size_t m = mlen ? mlen - LZ_MIN : 0;
+        RB_PUSH(uint8_t, out) = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+        if (nlit >= 15)
+                lz_length(out, nlit - 15);
+        rb_append(out, lit, nlit);
+        if (!mlen)
+                return;
+        RB_PUSH(uint8_t, out) = dist;
+        RB_PUSH(uint8_t, out) = dist >> 8;
+        if (m >= 15)
+                lz_length(out, m - 15);
+}
+
+static uint32_t
+lz_read32(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+/* false if the hash table can't be allocated */
+static bool
+lz_compress(const uint8_t *in, size_t n, rb_t *out)
+{
+        uint32_t *table = calloc(1 << LZ_HASH_BITS, sizeof(uint32_t));
+        if (!table)
+                return false;
+        size_t lit = 0, i = 0;
+        while (n >= LZ_MIN && i <= n - LZ_MIN) {
+                uint32_t h = (lz_read32(in + i) * 2654435761u) >> (32 - LZ_HASH_BITS);
+                size_t cand = table[h];
+                table[h] = i + 1;
+                if (!cand-- || i - cand > 0xFFFF || lz_read32(in + cand) != lz_read32(in + i)) {
+                        i++;
+                        continue;
+                }
+                size_t len = LZ_MIN;
+                while (i + len < n && in[cand + len] == in[i + len])
+                        len++;
+                lz_sequence(out, in + lit, i - lit, i - cand, len);
+                i += len;
+                lit = i;
+        }
+        lz_sequence(out, in + lit, n - lit, 0, 0);
+        free(table);
+        return true;
+}
+
+/* read a continued length, false if it runs off the end */
+static bool
+lz_more(const uint8_t **p, const uint8_t *end, size_t *n)
+{
+        uint8_t b;
+        do {
+                if (*p == end)
+                        return false;
+                b = *(*p)++;
+                *n += b;
+        } while (b == 255);
+        return true;
+}
+
+static bool
+lz_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t outlen)
+{
+        const uint8_t *end = in + n;
+        size_t o = 0;
+        while (in < end) {
+                uint8_t token = *in++;
+                size_t nlit = token >> 4, mlen = token & 15;
+                if (nlit == 15 && !lz_more(&in, end, &nlit))
+                        return false;
+                if (nlit > (size_t)(end - in) || nlit > outlen - o)
+                        return false;
+                memcpy(out + o, in, nlit);
+                in += nlit;
+                o += nlit;
+                if (in == end)
+                        break;
+                if (end - in < 2)
+                        return false;
+                size_t dist = in[0] | in[1] << 8;
+                in += 2;
+                if (mlen == 15 && !lz_more(&in, end, &mlen))
+                        return false;
+                mlen += LZ_MIN;
+                if (!dist || dist > o || mlen > outlen - o)
+                        return false;
+                /* may overlap, byte at a time */
+                for (size_t j = 0; j < mlen; j++, o++)
+                        out[o] = out[o - dist];
+        }
+        return o == outlen;
+}
+
+/* the transform */
+
+struct cached {
+        uint8_t len;
+        uint8_t bytes[sizeof(struct wide) + sizeof(struct header)];
+};
+
+static unsigned
+cache_slot(const void *bytes, size_t len)
+{
+        uint64_t w[sizeof(struct cached) / sizeof(uint64_t)] = { 0 };
+        memcpy(w, bytes, len);
+        uintptr_t h = w[0];
+        for (size_t i = 1; i < len / sizeof(uint64_t); i++)
+                h = hash_uintptr(h ^ w[i]);
+        return hash_uintptr(h) % PACK_CACHE;
+}
+
+static void
+put_varint(rb_t *out, uint64_t v)
+{
+        for (; v >= 0x80; v >>= 7)
+                RB_PUSH(uint8_t, out) = v | 0x80;
+        RB_PUSH(uint8_t, out) = v;
+}
+
+static bool
+get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+        *v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+                if (*p == end)
+                        return false;
+                uint8_t b = *(*p)++;
+                *v |= (uint64_t)(b & 0x7F) << shift;
+                if (!(b & 0x80))
+                        return true;
+        }
+        return false;
+}
+
+static uint64_t zigzag(int64_t v) { return (uint64_t)v << 1 ^ (uint64_t)(v >> 63); }
+static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+/* transform the objects in [from, to) of the image */
+static void
+pack_objects(struct frozen *ice, size_t from, size_t to, rb_t *out)
+{
+        struct cached cache[PACK_CACHE] = { { 0 } };
+        uintptr_t base = (uintptr_t)ice->base;
+        for (char *p = (char *)ice + from; p < (char *)ice + to;) {
+                struct header *head = _head_at(p);
+                size_t hlen = (char *)head->data - p;
+                struct cached *c = &cache[cache_slot(p, hlen)];
+                if (c->len == hlen && !memcmp(c->bytes, p, hlen)) {
+                        RB_PUSH(uint8_t, out) = c - cache;
+                } else {
+                        RB_PUSH(uint8_t, out) = PACK_RAW;
+                        rb_append(out, p, hlen);
+                        c->len = hlen;
+                        memcpy(c->bytes, p, hlen);
+                }
+                size_t bptrs = _head_bptrs(head), nptrs = _head_nptrs(head);
+                rb_append(out, head->data, bptrs * sizeof(void *));
+                void **ptrs = head->data + bptrs;
+                for (size_t i = 0; i < nptrs; i++) {
+                        uintptr_t v = (uintptr_t)ptrs[i];
+                        if (!v) {
+                                put_varint(out, 0);
+                        } else if (!(v & 1) && v - base < ice->length) {
+                                int64_t d = (int64_t)(v - base) - ((char *)&ptrs[i] - (char *)ice);
+                                if (d % (int64_t)sizeof(void *))
+                                        put_varint(out, zigzag(d) << 2 | 3);
+                                else
+                                        put_varint(out, zigzag(d / (int64_t)sizeof(void *)) << 2 | 1);
+                        } else {
+                                put_varint(out, 2);
+                                rb_append(out, &v, sizeof(v));
+                        }
+                }
+                char *rest = (char *)(ptrs + nptrs), *next = _head_next(head);
+                rb_append(out, rest, next - rest);
+                p = next;
+        }
+}
+
+/* undo pack_objects into the image at out covering [from, to) */
+static bool
+unpack_objects(const uint8_t *in, size_t n, struct frozen *out, size_t from, size_t to)
+{
+        struct cached cache[PACK_CACHE] = { { 0 } };
+        const uint8_t *end = in + n;
+        char *p = (char *)out + from, *stop = (char *)out + to;
+        while (p < stop) {
+                if (in == end)
+                        return false;
+                uint8_t token = *in++;
+                struct cached *c;
+                if (token == PACK_RAW) {
+                        int32_t tsz;
+                        if ((size_t)(end - in) < sizeof(struct header))
+                                return false;
+                        memcpy(&tsz, in, sizeof(tsz));
+                        size_t hlen = tsz == _YOINK_WIDE ?
+                                      sizeof(struct wide) + sizeof(struct header) : sizeof(struct header);
+                        if ((size_t)(end - in) < hlen)
+                                return false;
+                        c = &cache[cache_slot(in, hlen)];
+                        c->len = hlen;
+                        memcpy(c->bytes, in, hlen);
+                        in += hlen;
+                } else if (token < PACK_CACHE && cache[token].len) {
+                        c = &cache[token];
+                } else
+                        return false;
+                if ((size_t)(stop - p) < c->len)
+                        return false;
+                memcpy(p, c->bytes, c->len);
+                struct header *head = _head_at(p);
+                size_t tsz = _head_tsz(head), bptrs = _head_bptrs(head), nptrs = _head_nptrs(head);
+                if (tsz > (size_t)(stop - (char *)head->data) || bptrs > tsz / sizeof(void *) ||
+                    nptrs > tsz / sizeof(void *) - bptrs)
+                        return false;
+                if ((size_t)(end - in) < bptrs * sizeof(void *))
+                        return false;
+                memcpy(head->data, in, bptrs * sizeof(void *));
+                in += bptrs * sizeof(void *);
+                void **ptrs = head->data + bptrs;
+                for (size_t i = 0; i < nptrs; i++) {
+                        uint64_t v;
+                        if (!get_varint(&in, end, &v))
+                                return false;
+                        if (v == 0) {
+                                ptrs[i] = NULL;
+                        } else if (v & 1) {
+                                int64_t d = unzigzag(v >> 2) * ((v & 3) == 1 ? (int64_t)sizeof(void *) : 1);
+                                size_t t = (char *)&ptrs[i] - (char *)out + d;
+                                if (t < sizeof(struct frozen) || t >= out->length)
+                                        return false;
+                                ptrs[i] = (char *)out + t;
+                        } else if (v == 2 && (size_t)(end - in) >= sizeof(void *)) {
+                                memcpy(&ptrs[i], in, sizeof(void *));
+                                in += sizeof(void *);
+                        } else
+                                return false;
+                }
+                char *rest = (char *)(ptrs + nptrs), *next = (char *)head->data + tsz;
+                if ((size_t)(end - in) < (size_t)(next - rest))
+                        return false;
+                memcpy(rest, in, next - rest);
+                in += next - rest;
+                p = next;
+        }
+        return in == end && p == stop;
+}
+
+static bool
+pack_block(struct frozen *ice, struct pack_block *b, rb_t *out, rb_t *scratch)
+{
+        rb_clear(scratch);
+        if (b->kind == BLOCK_OBJECTS)
+                pack_objects(ice, b->offset, b->offset + b->length, scratch);
+        else
+                rb_append(scratch, (char *)ice + b->offset, b->length);
+        b->tsize = rb_len(scratch);
+        b->at = rb_len(out);
+        if (!lz_compress(rb_ptr(scratch), rb_len(scratch), out))
+                return false;
+        b->size = rb_len(out) - b->at;
+        return true;
+}
+
+void *
+yoink_pack(struct frozen *ice, size_t *len)
+{
+        if (ice->magic != _yoink_signature())
+                return NULL;
+        size_t objs = ice->relocs ? ice->relocs : ice->length;
+        rb_t blocks = RB_BLANK, data = RB_BLANK, scratch = RB_BLANK;
+        /* cut the objects into blocks at object boundaries */
+        size_t start = sizeof(struct frozen);
+        for (char *p = (char *)ice->data; p < (char *)ice + objs;) {
+                p = _head_next(_head_at(p));
+                size_t at = p - (char *)ice;
+                if (at - start >= PACK_BLOCK || at >= objs) {
+                        RB_PUSH(struct pack_block, &blocks) = (struct pack_block) {
+                                .offset = start, .length = at - start, .kind = BLOCK_OBJECTS
+                        };
+                        start = at;
+                }
+        }
+        for (; start < ice->length; start += PACK_BLOCK) {
+                size_t n = ice->length - start < PACK_BLOCK ? ice->length - start : PACK_BLOCK;
+                RB_PUSH(struct pack_block, &blocks) = (struct pack_block) {
+                        .offset = start, .length = n, .kind = BLOCK_RAW
+                };
+        }
+        size_t nblocks = RB_NITEMS(struct pack_block, &blocks);
+        bool ok = true;
+        RB_FOR(struct pack_block, b, &blocks)
+                if (ok)
+                        ok = pack_block(ice, b, &data, &scratch);
+        rb_free(&scratch);
+        if (!ok) {
+                rb_free(&blocks);
+                rb_free(&data);
+                return NULL;
+        }
+        struct pack hdr = {
+                .magic = _yoink_signature() ^ PACK_MAGIC, .length = ice->length,
+                .relocs = ice->relocs, .nblocks = nblocks,
+                .root = (uintptr_t)ice->root,
+        };
+        uintptr_t r = (uintptr_t)ice->root;
+        if (!(r & 1) && r - (uintptr_t)ice->base < ice->length)
+                hdr.root = (r - (uintptr_t)ice->base) | 2;
+        rb_t out = RB_BLANK;
+        rb_append(&out, &hdr, sizeof(hdr));
+        rb_append(&out, rb_ptr(&blocks), rb_len(&blocks));
+        rb_append(&out, rb_ptr(&data), rb_len(&data));
+        rb_free(&blocks);
+        rb_free(&data);
+        if (len)
+                *len = rb_len(&out);
+        return rb_take(&out);
+}
+
+struct unpack {
+        const struct pack *pk;
+        const uint8_t *data;
+        size_t datalen;
+        struct frozen *out;
+        _Atomic size_t next;
+        _Atomic bool failed;
+};
+
+static void *
+unpack_worker(void *varg)
+{
+        struct unpack *up = varg;
+        uint8_t *scratch = NULL;
+        size_t have = 0, i;
+        while ((i = atomic_fetch_add(&up->next, 1)) < up->pk->nblocks && !up->failed) {
+                const struct pack_block *b = &up->pk->blocks[i];
+                if (b->at > up->datalen || b->size > up->datalen - b->at ||
+                    b->offset < sizeof(struct frozen) || b->offset > up->pk->length ||
+                    b->length > up->pk->length - b->offset) {
+                        up->failed = true;
+                        break;
+                }
+                const uint8_t *in = up->data + b->at;
+                bool ok;
+                if (b->kind == BLOCK_RAW) {
+                        ok = b->tsize == b->length &&
+                             lz_decompress(in, b->size, (uint8_t *)up->out + b->offset, b->length);
+                } else {
+                        if (b->tsize > have) {
+                                free(scratch);
+                                scratch = malloc(have = b->tsize);
+                        }
+                        ok = scratch && lz_decompress(in, b->size, scratch, b->tsize) &&
+                             unpack_objects(scratch, b->tsize, up->out, b->offset, b->offset + b->length);
+                }
+                if (!ok)
+                        up->failed = true;
+        }
+        free(scratch);
+        return NULL;
+}
+
+struct frozen *
+yoink_unpack(const void *buf, size_t len, int nthreads)
+{
+        const struct pack *pk = buf;
+        if (len < sizeof(struct pack) || pk->magic != (_yoink_signature() ^ PACK_MAGIC) ||
+            pk->length < sizeof(struct frozen) || pk->relocs > pk->length ||
+            pk->nblocks > (len - sizeof(struct pack)) / sizeof(struct pack_block))
+                return NULL;
+        /* the blocks have to cover the image in order, objects then raw */
+        size_t at = sizeof(struct frozen), objs = pk->relocs ? pk->relocs : pk->length;
+        for (size_t i = 0; i < pk->nblocks; i++) {
+                const struct pack_block *b = &pk->blocks[i];
+                if (b->offset != at || b->length > pk->length - at ||
+                    b->kind != (at < objs ? BLOCK_OBJECTS : BLOCK_RAW))
+                        return NULL;
+                at += b->length;
+                if (b->kind == BLOCK_OBJECTS && at > objs)
+                        return NULL;
+        }
+        if (at != pk->length)
+                return NULL;
+        if (nthreads < 1)
+                nthreads = 1;
+        if ((uint64_t)nthreads > pk->nblocks)
+                nthreads = pk->nblocks ? pk->nblocks : 1;
+        if (nthreads > _YOINK_MAX_THREADS)
+                nthreads = _YOINK_MAX_THREADS;
+        size_t hlen = sizeof(struct pack) + pk->nblocks * sizeof(struct pack_block);
+        struct unpack up = {
+                .pk = pk, .data = (const uint8_t *)buf + hlen, .datalen = len - hlen,
+                .out = calloc(1, pk->length),
+        };
+        if (!up.out)
+                return NULL;
+        up.out->length = pk->length;
+        atomic_init(&up.next, 0);
+        atomic_init(&up.failed, false);
+        /* blocks are taken from a counter so fewer threads will do */
+        pthread_t threads[nthreads];
+        int started = 1;
+        while (started < nthreads && !pthread_create(&threads[started], NULL, unpack_worker, &up))
+                started++;
+        unpack_worker(&up);
+        for (int i = 1; i < started; i++)
+                pthread_join(threads[i], NULL);
+        if (up.failed) {
+                free(up.out);
+                return NULL;
+        }
+        struct frozen *fz = up.out;
+        fz->magic = _yoink_signature();
+        fz->relocs = pk->relocs;
+        fz->base = fz;
+        fz->root = (void *)(uintptr_t)pk->root;
+        if ((pk->root & 3) == 2) {
+                if ((pk->root & ~(uint64_t)3) >= pk->length) {
+                        free(fz);
+                        return NULL;
+                }
+                fz->root = (char *)fz + (pk->root & ~(uint64_t)3);
+        }
+        return fz;
+}
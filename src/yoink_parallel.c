@@ -0,0 +1,629 @@
+#include <inttypes.h>
+#include <errno.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include "yoink.h"
+#include "yoink_trace.h"
+#include "resizable_buf.h"
+
+/* Parallel tracing and copying.
+ *
+ * Every worker owns a work stealing deque of copies whose pointers still need
+ * to be forwarded and copies into its own local allocation buffer. Source
+ * objects are claimed with a compare and swap on their first word, the
+ * claimer copies the object then publishes a forwarding pointer just like the
+ * destructive yoink does. Each worker remembers what it claimed along with the
+ * original first word so the source is put back the way it was at the end.
+ */
+
+/* placed in the first word of an object while it is being copied */
+static char busy;
+#define BUSY ((void *)&busy)
+
+/* Chase-Lev work stealing deque, the owner pushes and takes from the bottom
+ * while thieves steal from the top. arrays that are outgrown are kept around
+ * until the deque is freed since a thief may still be reading them. */
+struct deque_array {
+        int64_t size;
+        _Atomic(struct header *) buf[];
+};
+
+struct deque {
+        _Atomic int64_t top, bottom;
+        struct deque_array *_Atomic array;
+        rb_t retired;
+};
+
+static struct deque_array *
+deque_array_new(int64_t size)
+{
+        struct deque_array *a = calloc(1, sizeof(*a) + size * sizeof(a->buf[0]));
+        a->size = size;
+        return a;
+}
+
+static void
+deque_init(struct deque *d)
+{
+        atomic_init(&d->top, 0);
+        atomic_init(&d->bottom, 0);
+        atomic_init(&d->array, deque_array_new(1024));
+        d->retired = (rb_t)RB_BLANK;
+}
+
+static void
+deque_free(struct deque *d)
+{
+        free(atomic_load(&d->array));
+        RB_FOR(struct deque_array *, a, &d->retired)
+                free(*a);
+        rb_free(&d->retired);
+}
+
+static void
+deque_push(struct deque *d, struct header *x)
+{
+        int64_t b = atomic_load(&d->bottom);
+        int64_t t = atomic_load(&d->top);
+        struct deque_array *a = atomic_load(&d->array);
+        if (b - t >= a->size) {
+                struct deque_array *n = deque_array_new(a->size * 2);
+                for (int64_t i = t; i < b; i++)
+                        atomic_store(&n->buf[i % n->size], atomic_load(&a->buf[i % a->size]));
+                RB_PUSH(struct deque_array *, &d->retired) = a;
+                atomic_store(&d->array, n);
+                a = n;
+        }
+        atomic_store(&a->buf[b % a->size], x);
+        atomic_store(&d->bottom, b + 1);
+}
+
+static struct header *
+deque_take(struct deque *d)
+{
+        int64_t b = atomic_load(&d->bottom) - 1;
+        struct deque_array *a = atomic_load(&d->array);
+        atomic_store(&d->bottom, b);
+        int64_t t = atomic_load(&d->top);
+        if (t > b) {
+                atomic_store(&d->bottom, b + 1);
+                return NULL;
+        }
+        struct header *x = atomic_load(&a->buf[b % a->size]);
+        if (t == b) {
+                if (!atomic_compare_exchange_strong(&d->top, &t, t + 1))
+                        x = NULL;
+                atomic_store(&d->bottom, b + 1);
+        }
+        return x;
+}
+
+static struct header *
+deque_steal(struct deque *d)
+{
+        int64_t t = atomic_load(&d->top);
+        int64_t b = atomic_load(&d->bottom);
+        if (t >= b)
+                return NULL;
+        struct deque_array *a = atomic_load(&d->array);
+        struct header *x = atomic_load(&a->buf[t % a->size]);
+        if (!atomic_compare_exchange_strong(&d->top, &t, t + 1))
+                return NULL;
+        return x;
+}
+
+static bool
+deque_empty(struct deque *d)
+{
+        return atomic_load(&d->top) >= atomic_load(&d->bottom);
+}
+
+struct claim {
+        struct header *head;
+        void *word;
+};
+
+struct pyoink;
+
+struct worker {
+        struct pyoink *py;
+        int id;
+        pthread_t thread;
+        struct deque deque;
+        ArenaLocal local;
+        rb_t claimed;
+        rb_t weak;              // copies of weak objects, fixed up at the end
+        ssize_t tlen;
+        unsigned seed;
+};
+
+struct pyoink {
+        Arena *to;
+        int nthreads;
+        struct worker *workers;
+        bool weak;              // honour YFLAG_WEAK, copies for freezing don't
+        _Atomic int active;
+        pthread_barrier_t barrier;
+};
+
+/* return where p has been copied to, copying it if nobody has claimed it
+ * yet. */
+static void *
+par_forward(struct worker *w, void *p)
+{
+        if (_arena_index_find(w->py->to, p))
+                return p;
+        struct header *head = container_of(p, struct header, data);
+        _Atomic(void *) *word = (_Atomic(void *) *)&head->data[0];
+        _Atomic uint8_t *flags = (_Atomic uint8_t *)&head->flags;
+        for (;;) {
+                /* the word has to be read before the flags, the claimer sets
+                 * the flag before it stores the forwarding pointer so seeing
+                 * no flag means the word is still the original. */
+                void *v = atomic_load(word);
+                if (atomic_load(flags) & YFLAG_FORWARDED) {
+                        while ((v = atomic_load(word)) == BUSY)
+                                sched_yield();
+                        return v;
+                }
+                if (v == BUSY) {
+                        sched_yield();
+                        continue;
+                }
+                if (!atomic_compare_exchange_strong(word, &v, BUSY))
+                        continue;
+                size_t tsz = _head_tsz(head);
+                assert(tsz >= sizeof(void *));
+                struct header *nhead = _arena_local_clone_header(&w->local, head);
+                memcpy(nhead->data + 1, head->data + 1, tsz - sizeof(void *));
+                nhead->data[0] = v;
+                w->tlen += tsz;
+                RB_PUSH(struct claim, &w->claimed) = (struct claim) { head, v };
+                if (_yoink_null_children(nhead))
+                        ;
+                else if (nhead->flags & YFLAG_WEAK && w->py->weak)
+                        RB_PUSH(struct header *, &w->weak) = nhead;
+                else if (_head_nptrs(nhead))
+                        deque_push(&w->deque, nhead);
+                atomic_fetch_or(flags, YFLAG_FORWARDED);
+                atomic_store(word, nhead->data);
+                return nhead->data;
+        }
+}
+
+static void
+par_scan(struct worker *w, struct header *head)
+{
+        void **ptrs = head->data + _head_bptrs(head);
+        size_t nptrs = _head_nptrs(head);
+        for (size_t i = 0; i < nptrs; i++)
+                if (_yoink_follow(&ptrs[i]))
+                        ptrs[i] = par_forward(w, ptrs[i]);
+}
+
+static struct header *
+par_steal(struct worker *w)
+{
+        struct pyoink *py = w->py;
+        for (int i = 0; i < py->nthreads; i++) {
+                struct worker *v = &py->workers[rand_r(&w->seed) % py->nthreads];
+                if (v == w)
+                        continue;
+                struct header *x = deque_steal(&v->deque);
+                if (x)
+                        return x;
+        }
+        return NULL;
+}
+
+static bool
+par_work_left(struct pyoink *py)
+{
+        for (int i = 0; i < py->nthreads; i++)
+                if (!deque_empty(&py->workers[i].deque))
+                        return true;
+        return false;
+}
+
+/* weak pointers follow what was copied, read through the forwarding pointers
+ * before they are taken down, and lose what was left behind */
+static void *
+par_resolve(void *arg, void *p)
+{
+        struct pyoink *py = arg;
+        void *q = p;
+        if (!_yoink_follow(&q) || _arena_index_find(py->to, p))
+                return q;
+        struct header *head = container_of(p, struct header, data);
+        return head->flags & YFLAG_FORWARDED ? head->data[0] : NULL;
+}
+
+static void *
+par_worker(void *varg)
+{
+        struct worker *w = varg;
+        struct pyoink *py = w->py;
+        for (;;) {
+                struct header *x;
+                while ((x = deque_take(&w->deque)) || (x = par_steal(w)))
+                        par_scan(w, x);
+                /* out of work, only stop once every worker is */
+                atomic_fetch_sub(&py->active, 1);
+                for (;;) {
+                        if (!atomic_load(&py->active))
+                                goto done;
+                        if (par_work_left(py)) {
+                                atomic_fetch_add(&py->active, 1);
+                                if ((x = par_steal(w))) {
+                                        par_scan(w, x);
+                                        break;
+                                }
+                                atomic_fetch_sub(&py->active, 1);
+                        }
+                        sched_yield();
+                }
+        }
+done:
+        /* tracing is over everywhere, the first worker fixes up the weak
+         * objects on its own as that can push onto the weak queue */
+        pthread_barrier_wait(&py->barrier);
+        if (!w->id)
+                for (int i = 0; i < py->nthreads; i++)
+                        _yoink_weak_fixup(py->to, &py->workers[i].weak, par_resolve, py);
+        /* nobody reads forwarding pointers any more, put the source back */
+        pthread_barrier_wait(&py->barrier);
+        RB_FOR(struct claim, c, &w->claimed) {
+                c->head->data[0] = c->word;
+                c->head->flags &= ~YFLAG_FORWARDED;
+        }
+        arena_detach(&w->local);
+        return NULL;
+}
+
+/* copy everything reachable from roots into to using nthreads threads. */
+static ssize_t
+par_yoink(Arena *to, int nroots, void *root[nroots], int nthreads, bool weak)
+{
+        if (nthreads < 1)
+                nthreads = 1;
+        if (nthreads > _YOINK_MAX_THREADS)
+                nthreads = _YOINK_MAX_THREADS;
+        struct pyoink py = { .to = to, .nthreads = nthreads, .weak = weak };
+        struct worker workers[nthreads];
+        py.workers = workers;
+        atomic_init(&py.active, nthreads);
+        _arena_index_refresh(to);
+        for (int i = 0; i < nthreads; i++) {
+                struct worker *w = &workers[i];
+                w->py = &py;
+                w->id = i;
+                w->claimed = (rb_t)RB_BLANK;
+                w->weak = (rb_t)RB_BLANK;
+                w->tlen = 0;
+                w->seed = i + 1;
+                deque_init(&w->deque);
+                arena_attach(&w->local, to);
+        }
+        for (int i = 0; i < nroots; i++)
+                if (_yoink_follow(&root[i]))
+                        root[i] = par_forward(&workers[0], root[i]);
+        /* workers that couldn't be started are never active and have nothing
+         * to steal. nobody reaches the barrier before the first worker runs
+         * out of work so it can be sized once they are all started. */
+        int started = 1;
+        while (started < nthreads &&
+               !pthread_create(&workers[started].thread, NULL, par_worker, &workers[started]))
+                started++;
+        atomic_fetch_sub(&py.active, nthreads - started);
+        pthread_barrier_init(&py.barrier, NULL, started);
+        par_worker(&workers[0]);
+        ssize_t tlen = workers[0].tlen;
+        for (int i = 1; i < started; i++) {
+                pthread_join(workers[i].thread, NULL);
+                tlen += workers[i].tlen;
+        }
+        for (int i = 0; i < nthreads; i++) {
+                deque_free(&workers[i].deque);
+                rb_free(&workers[i].claimed);
+                rb_free(&workers[i].weak);
+        }
+        pthread_barrier_destroy(&py.barrier);
+        _arena_index_release(to);
+        return tlen;
+}
+
+ssize_t
+yoinks_to_arena_parallel(Arena *to, int nroots, void *root[nroots], int nthreads)
+{
+        return par_yoink(to, nroots, root, nthreads, true);
+}
+
+/* yoink_to_malloc copies into a scratch arena in parallel and then lays the
+ * blocks of the scratch arena out one after another in the final buffer. each
+ * scratch copy is sent to the buffer and its first word replaced by its final
+ * address, after which the pointers in the buffer can be fixed up by reading
+ * through the scratch copies they still point to.
+ *
+ * Freezing is the same with the headers kept, every block is a sub-image
+ * copied and fixed up on its own and they are stitched together by their
+ * offsets. The relocation bitmap is shared by neighbouring blocks so bits are
+ * gathered a word at a time and or'ed in atomically. */
+struct block {
+        void *first;            // where the first object in the block starts
+        char *end;              // end of the headers
+        size_t offset;          // where the block starts in the output
+};
+
+struct compact {
+        Arena *scratch;
+        struct block *blocks;
+        size_t nblocks;
+        bool meta;              // keep the headers
+        char *out;
+        char *image;            // what relocs counts words from
+        _Atomic uint64_t *relocs;
+        _Atomic size_t next, fixup;
+};
+
+#define BLOCK_AT(b, p) ((char *)(p) < (b)->end ? _head_at(p) : NULL)
+#define BLOCK_FOR(h, b) \
+        for (struct header *h = BLOCK_AT(b, (b)->first); h; h = BLOCK_AT(b, _head_next(h)))
+
+/* bytes an object takes in the output */
+static size_t
+compact_size(struct compact *cp, struct header *h)
+{
+        return _head_tsz(h) + (cp->meta ? (char *)h->data - (char *)_head_start(h) : 0);
+}
+
+static void
+relocs_flush(struct compact *cp, size_t word, uint64_t bits)
+{
+        if (bits)
+                atomic_fetch_or(&cp->relocs[word], bits);
+}
+
+static void *
+compact_copy(void *varg)
+{
+        struct compact *cp = varg;
+        size_t i;
+        while ((i = atomic_fetch_add(&cp->next, 1)) < cp->nblocks) {
+                struct block *b = &cp->blocks[i];
+                char *out = cp->out + b->offset;
+                BLOCK_FOR(h, b) {
+                        size_t tsz = _head_tsz(h), prefix = compact_size(cp, h) - tsz;
+                        memcpy(out, (char *)h->data - prefix, prefix + tsz);
+                        h->data[0] = out + prefix;
+                        out += prefix + tsz;
+                }
+        }
+        return NULL;
+}
+
+static void *
+compact_fixup(void *varg)
+{
+        struct compact *cp = varg;
+        size_t i;
+        while ((i = atomic_fetch_add(&cp->fixup, 1)) < cp->nblocks) {
+                struct block *b = &cp->blocks[i];
+                char *out = cp->out + b->offset;
+                size_t word = 0;
+                uint64_t bits = 0;
+                BLOCK_FOR(h, b) {
+                        size_t size = compact_size(cp, h);
+                        void **ptrs = (void **)(out + size - _head_tsz(h)) + _head_bptrs(h);
+                        size_t nptrs = _head_nptrs(h);
+                        for (size_t j = 0; j < nptrs; j++) {
+                                if (IS_RAW(ptrs[j]) || !_arena_index_find(cp->scratch, ptrs[j]))
+                                        continue;
+                                ptrs[j] = *(void **)ptrs[j];
+                                if (!cp->relocs)
+                                        continue;
+                                size_t w = (void **)&ptrs[j] - (void **)cp->image;
+                                if (w / 64 != word) {
+                                        relocs_flush(cp, word, bits);
+                                        word = w / 64;
+                                        bits = 0;
+                                }
+                                bits |= (uint64_t)1 << w % 64;
+                        }
+                        out += size;
+                }
+                if (cp->relocs)
+                        relocs_flush(cp, word, bits);
+        }
+        return NULL;
+}
+
+/* copy root into a scratch arena and work out where its blocks go, returns
+ * the total size of the output. */
+static size_t
+compact_prepare(struct compact *cp, void *root, int nthreads, rb_t *blocks)
+{
+        /* the root is always copied whatever its flags say */
+        struct header *orhead = container_of(root, struct header, data);
+        uint8_t rflags = orhead->flags;
+        orhead->flags &= ~(YFLAG_NULL_SELF | YFLAG_ALIAS_SELF);
+        par_yoink(cp->scratch, 1, &root, nthreads, false);
+        orhead->flags = rflags;
+        /* aliased pointers are left alone when fixing up */
+        _arena_index_refresh(cp->scratch);
+        struct header *rhead = container_of(root, struct header, data);
+        for (struct slab *s = cp->scratch->slabs; s; s = s->next)
+                RB_PUSH(struct block, blocks) = (struct block) {
+                        s->data, _slab_end(s)
+                };
+        for (struct chain *c = cp->scratch->chain; c; c = c->next)
+                RB_PUSH(struct block, blocks) = (struct block) {
+                        &c->head, _head_next(_CHAIN_HEAD(c))
+                };
+        /* the root was the first thing copied so it begins its block, put
+         * that block first so the root is at the start of the buffer */
+        struct block *bs = rb_ptr(blocks);
+        size_t nblocks = RB_NITEMS(struct block, blocks);
+        for (size_t i = 0; i < nblocks; i++)
+                if (bs[i].first == _head_start(rhead)) {
+                        struct block t = bs[0];
+                        bs[0] = bs[i];
+                        bs[i] = t;
+                }
+        assert(bs[0].first == _head_start(rhead));
+        size_t total = 0;
+        for (size_t i = 0; i < nblocks; i++) {
+                bs[i].offset = total;
+                BLOCK_FOR(h, &bs[i])
+                        total += compact_size(cp, h);
+        }
+        cp->blocks = bs;
+        cp->nblocks = nblocks;
+        return total;
+}
+
+/* run fn on this thread and up to nthreads - 1 others, as many as can be
+ * started. fn takes its work from counters so any number of threads will do. */
+static void
+run_threads(void *(*fn)(void *), void *arg, int nthreads)
+{
+        if (nthreads > _YOINK_MAX_THREADS)
+                nthreads = _YOINK_MAX_THREADS;
+        pthread_t threads[nthreads];
+        int started = 1;
+        while (started < nthreads && !pthread_create(&threads[started], NULL, fn, arg))
+                started++;
+        fn(arg);
+        for (int i = 1; i < started; i++)
+                pthread_join(threads[i], NULL);
+}
+
+static void
+compact_run(struct compact *cp, int nthreads)
+{
+        atomic_init(&cp->next, 0);
+        atomic_init(&cp->fixup, 0);
+        /* the first pass has to be done before anyone starts the second */
+        run_threads(compact_copy, cp, nthreads);
+        run_threads(compact_fixup, cp, nthreads);
+}
+
+void *
+yoink_to_malloc_parallel(void *root, size_t *len, int nthreads)
+{
+        if (len)
+                *len = 0;
+        if (IS_RAW(root))
+                return NULL;
+        if (nthreads < 1)
+                nthreads = 1;
+        Arena scratch = ARENA_SLAB_INIT;
+        rb_t blocks = RB_BLANK;
+        struct compact cp = { .scratch = &scratch };
+        size_t total = compact_prepare(&cp, root, nthreads, &blocks);
+        cp.out = malloc(total);
+        if (cp.out)
+                compact_run(&cp, nthreads);
+        rb_free(&blocks);
+        _arena_index_release(&scratch);
+        arena_free(&scratch);
+        if (!cp.out)
+                return NULL;
+        if (len)
+                *len = total;
+        return cp.out;
+}
+
+struct frozen *
+yoink_freeze_parallel(void *root, int nthreads)
+{
+        if (IS_RAW(root) || nthreads <= 1)
+                return yoink_freeze(root, NULL);
+        Arena scratch = ARENA_SLAB_INIT;
+        rb_t blocks = RB_BLANK;
+        struct compact cp = { .scratch = &scratch, .meta = true };
+        size_t objs = sizeof(struct frozen) + compact_prepare(&cp, root, nthreads, &blocks);
+        size_t len = objs + _relocs_size(objs);
+        struct frozen *fz = malloc(len);
+        if (!fz) {
+                rb_free(&blocks);
+                _arena_index_release(&scratch);
+                arena_free(&scratch);
+                return NULL;
+        }
+        memset((char *)fz + objs, 0, len - objs);
+        cp.image = (char *)fz;
+        cp.out = (char *)fz->data;
+        cp.relocs = (_Atomic uint64_t *)((char *)fz + objs);
+        compact_run(&cp, nthreads);
+        struct header *rhead = _head_at(fz->data);
+        fz->magic = _yoink_signature();
+        fz->length = len;
+        fz->base = fz;
+        fz->root = rhead->data;
+        fz->relocs = objs;
+        fz->flags = YOINK_FROZEN_CRC;
+        fz->crc = yoink_frozen_crc(fz);
+        rb_free(&blocks);
+        _arena_index_release(&scratch);
+        arena_free(&scratch);
+        return fz;
+}
+
+/* worked out before starting, the vector kernels store back whole vectors so
+ * the image header is rewritten by whoever has the first block */
+struct thaw_range {
+        uintptr_t *words;
+        const uint64_t *bits;
+        size_t nwords;
+        ptrdiff_t offset;
+};
+
+static void *
+thaw_worker(void *varg)
+{
+        struct thaw_range *r = varg;
+        if (r->nwords)
+                _yoink_rebase(r->words, r->bits, r->nwords, r->offset);
+        return NULL;
+}
+
+void *
+yoink_thaw_parallel(struct frozen *ice, int nthreads)
+{
+        if (ice->magic != _yoink_signature())
+                return NULL;
+        if (ice->base == ice)
+                return ice->root;
+        if (!ice->relocs || nthreads <= 1)
+                return yoink_thaw(ice);
+        /* the bitmap is flat so any split into whole blocks will do */
+        size_t nwords = ice->relocs / sizeof(void *), nblocks = (nwords + 63) / 64;
+        const uint64_t *bits = (uint64_t *)((char *)ice + ice->relocs);
+        ptrdiff_t offset = (char *)ice - (char *)ice->base;
+        if ((size_t)nthreads > nblocks)
+                nthreads = nblocks;
+        if (nthreads > _YOINK_MAX_THREADS)
+                nthreads = _YOINK_MAX_THREADS;
+        struct thaw_range ranges[nthreads];
+        pthread_t threads[nthreads];
+        for (int i = 0; i < nthreads; i++) {
+                size_t from = nblocks * i / nthreads * 64, to = nblocks * (i + 1) / nthreads * 64;
+                ranges[i] = (struct thaw_range) {
+                        (uintptr_t *)ice + from, bits + from / 64,
+                        (to < nwords ? to : nwords) - from, offset
+                };
+        }
+        int started = 1;
+        while (started < nthreads && !pthread_create(&threads[started], NULL, thaw_worker, &ranges[started]))
+                started++;
+        /* ranges nobody could be started for are done here */
+        for (int i = started; i < nthreads; i++)
+                thaw_worker(&ranges[i]);
+        thaw_worker(&ranges[0]);
+        for (int i = 1; i < started; i++)
+                pthread_join(threads[i], NULL);
+        return _yoink_thaw_finish(ice);
+}
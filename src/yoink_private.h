@@ -2,6 +2,10 @@
 #define YOINK_PRIVATE_H
 /* some private definitions we don't want to clutter our public header */
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
 
 #ifdef __GNUC__
 #define _MALLOC \
@@ -16,6 +20,11 @@
 #define _SENTINEL
 #endif
 
+#define container_of(ptr, type, member) \
+       (type *)( (char *)(ptr) - offsetof(type, member) )
+
+/* NULL and tagged values are not pointers to objects */
+#define IS_RAW(p)  ((p) == NULL || ((uintptr_t)(p) & 1))
 
 struct chain;
 struct Arena;
@@ -24,17 +33,221 @@ struct header {
         int32_t tsz;
         int16_t nptrs;
         int8_t  bptrs;
-        int8_t  flags;
+        uint8_t flags;
         void *data[];
 };
 
+/* objects whose sizes don't fit in struct header get a wide prefix holding
+ * the real sizes in front of their header, both have tsz set to _YOINK_WIDE.
+ * Code walking from header to header lands on the prefix and steps over it to
+ * the object header with _head_at, everything else gets the sizes with the
+ * _head_ accessors below rather than reading the fields. Small objects, which
+ * is nearly all of them, keep the compact header. */
+#define _YOINK_WIDE (-1)
+
+struct wide {
+        int32_t mark;           // _YOINK_WIDE, where a header's tsz would be
+        int32_t unused;
+        uint64_t tsz;
+        uint64_t nptrs;
+        uint64_t bptrs;
+};
+
+static inline bool _head_needs_wide(size_t tsz, size_t nptrs, size_t bptrs)
+{
+        return tsz > INT32_MAX || nptrs > INT16_MAX || bptrs > INT8_MAX;
+}
+
+/* bytes in front of the data of an object with the given sizes */
+static inline size_t _head_prefix(size_t tsz, size_t nptrs, size_t bptrs)
+{
+        return sizeof(struct header) +
+               (_head_needs_wide(tsz, nptrs, bptrs) ? sizeof(struct wide) : 0);
+}
+
+static inline struct wide *_head_wide(struct header *head)
+{
+        return head->tsz == _YOINK_WIDE ? (struct wide *)head - 1 : NULL;
+}
+
+static inline size_t _head_tsz(struct header *head)
+{
+        return head->tsz == _YOINK_WIDE ? _head_wide(head)->tsz : (size_t)head->tsz;
+}
+
+static inline size_t _head_nptrs(struct header *head)
+{
+        return head->tsz == _YOINK_WIDE ? _head_wide(head)->nptrs : (size_t)head->nptrs;
+}
+
+static inline size_t _head_bptrs(struct header *head)
+{
+        return head->tsz == _YOINK_WIDE ? _head_wide(head)->bptrs : (size_t)head->bptrs;
+}
+
+/* where the allocation holding head starts */
+static inline void *_head_start(struct header *head)
+{
+        return head->tsz == _YOINK_WIDE ? (void *)_head_wide(head) : (void *)head;
+}
+
+/* the object whose allocation starts at p */
+static inline struct header *_head_at(void *p)
+{
+        struct header *head = p;
+        return head->tsz == _YOINK_WIDE ? (struct header *)((struct wide *)p + 1) : head;
+}
+
+/* where the allocation following head's starts */
+static inline void *_head_next(struct header *head)
+{
+        return (char *)head->data + _head_tsz(head);
+}
+
+/* fill in the header, and prefix if needed, for an object at p which must
+ * have room for _head_prefix bytes before the data. flags are cleared. */
+static inline struct header *_head_init(void *p, size_t tsz, size_t nptrs, size_t bptrs)
+{
+        if (!_head_needs_wide(tsz, nptrs, bptrs)) {
+                struct header *head = p;
+                *head = (struct header) { .tsz = tsz, .nptrs = nptrs, .bptrs = bptrs };
+                return head;
+        }
+        struct wide *w = p;
+        *w = (struct wide) { .mark = _YOINK_WIDE, .tsz = tsz, .nptrs = nptrs, .bptrs = bptrs };
+        struct header *head = (struct header *)(w + 1);
+        *head = (struct header) { .tsz = _YOINK_WIDE };
+        return head;
+}
+
+/* chains hold a single object, wide ones start with the prefix */
 struct chain {
         struct chain *next;
         struct header head;
         void *data[];
 };
 
+#define _CHAIN_HEAD(c) _head_at(&(c)->head)
+
+/* a slab is a large block that objects are carved out of with a bump pointer,
+ * each object is a struct header immediately followed by its data so a slab
+ * can be walked from data to _slab_end. */
+struct slab {
+        struct slab *next;
+        size_t size;            // bytes available in data
+        _Atomic size_t used;    // bytes handed out, may overshoot size
+        _Atomic size_t end;     // where carving stopped once the slab filled
+        void *data[];
+};
+
 void _arena_add_link(struct Arena *arena, struct chain *chain);
+/* hand a malloced slab that is already full over to the arena */
+void _arena_add_slab(struct Arena *arena, struct slab *s);
+
+/* allocate a header with room for tsz bytes of data, tsz must already be
+ * rounded up to a multiple of the pointer size. The header is filled in with
+ * the sizes, wide if they need it, and cleared flags. If zero is true the data
+ * is zero filled. Every object gets at least one word of data so there is
+ * always room for a forwarding pointer. */
+struct header *_arena_alloc_header(struct Arena *arena, size_t tsz, size_t nptrs, size_t bptrs, bool zero);
+
+struct ArenaLocal;
+struct header *_arena_local_header(struct ArenaLocal *local, size_t tsz, size_t nptrs, size_t bptrs, bool zero);
+
+/* allocate a copy of head with the same sizes and flags but no data */
+static inline struct header *_arena_clone_header(struct Arena *arena, struct header *head)
+{
+        struct header *nhead = _arena_alloc_header(arena, _head_tsz(head), _head_nptrs(head),
+                                                   _head_bptrs(head), false);
+        nhead->flags = head->flags;
+        return nhead;
+}
+
+static inline struct header *_arena_local_clone_header(struct ArenaLocal *local, struct header *head)
+{
+        struct header *nhead = _arena_local_header(local, _head_tsz(head), _head_nptrs(head),
+                                                   _head_bptrs(head), false);
+        nhead->flags = head->flags;
+        return nhead;
+}
+
+/* sweeping lazily. begin takes the blocks out of the arena to be marked in,
+ * mark returns true if the object wasn't marked already, dead whether the
+ * object is in the arena and unmarked, and start hands what wasn't marked
+ * over to be swept. finish sweeps whatever is left, returning the bytes it
+ * freed. */
+struct arena_sweep;
+struct arena_sweep *_arena_sweep_begin(struct Arena *arena);
+bool _arena_sweep_mark(struct arena_sweep *sw, struct header *head);
+bool _arena_sweep_dead(struct arena_sweep *sw, struct header *head);
+void _arena_sweep_start(struct Arena *arena, struct arena_sweep *sw);
+ssize_t _arena_sweep_finish(struct Arena *arena);
+
+/* bring the arena's address index up to date and hold it, _arena_index_find
+ * may then be called from many threads at once until it is released, as long
+ * as no blocks are freed. Other threads may refresh meanwhile, the indexes
+ * they replace are only freed once nobody holds one. drop discards the index
+ * and must be called whenever blocks are freed. */
+void _arena_index_refresh(struct Arena *arena);
+void _arena_index_release(struct Arena *arena);
+/* whether blocks were added since the index was last refreshed */
+bool _arena_index_stale(struct Arena *arena);
+bool _arena_index_find(struct Arena *arena, const void *p);
+void _arena_index_drop(struct Arena *arena);
+
+/* destructively move whatever the roots reach in from into to, objects in
+ * keep are left alone without being traced and anything else is traced in
+ * place. Returns the bytes moved. */
+ssize_t _yoinks_to_arena_from(struct Arena *to, struct Arena *from, struct Arena *keep,
+                              int nroots, void *root[nroots]);
+
+static inline char *_slab_end(struct slab *s)
+{
+        size_t used = atomic_load(&s->used), end = atomic_load(&s->end);
+        return (char *)s->data + (used < end ? used : end);
+}
+
+/* the object at p if it is before the end of the slab, NULL otherwise */
+static inline struct header *_slab_at(struct slab *s, void *p)
+{
+        return (char *)p < _slab_end(s) ? _head_at(p) : NULL;
+}
+
+#define _SLAB_FOR(h, s)                                                      \
+        for (struct header *h = _slab_at(s, (s)->data); h;                    \
+             h = _slab_at(s, _head_next(h)))
+
+/* identifies the machine frozen data was made on */
+uintptr_t _yoink_signature(void);
+
+/* the parallel functions keep per thread state on the stack, more threads
+ * than this are never started */
+#define _YOINK_MAX_THREADS 64
+
+/* files written by yoink_freeze_file have a page index after the image, for
+ * each _YOINK_PAGE bytes of the image a uint64_t with the offset of the
+ * object covering its start, followed by this trailer. It lets a page be
+ * relocated on its own without walking the image up to it. */
+#define _YOINK_PAGE 4096
+#define _YOINK_TRAILER_MAGIC 0x1DE7
+
+struct _yoink_trailer {
+        uintptr_t magic;        // signature ^ _YOINK_TRAILER_MAGIC
+        uintptr_t npages;       // entries in the index
+};
+
+/* bytes of relocation bitmap for len bytes of frozen header and objects, a
+ * bit per word rounded up to whole uint64_t. */
+static inline size_t _relocs_size(size_t len)
+{
+        return (len / sizeof(void *) + 63) / 64 * sizeof(uint64_t);
+}
+
+/* add offset to every word of w whose bit is set, and finish a thaw once
+ * the objects are relocated. */
+void _yoink_rebase(uintptr_t *w, const uint64_t *bits, size_t nwords, uintptr_t offset);
+struct frozen;
+void *_yoink_thaw_finish(struct frozen *ice);
 
 /* round up to next pointer size */
 #define _ARENA_RUP(x) (((x) + sizeof(void*) - 1)/sizeof(void*))
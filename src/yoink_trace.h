@@ -0,0 +1,49 @@
+#ifndef YOINK_TRACE_H
+#define YOINK_TRACE_H
+/* helpers shared by the tracers in the yoink source files, not part of the
+ * public header */
+#include <string.h>
+#include "yoink.h"
+#include "ptrhashtable2.h"
+#include "resizable_buf.h"
+
+#define _YFLAG_POLICY (YFLAG_NULL_CHILDREN | YFLAG_NULL_SELF | YFLAG_ALIAS_SELF | YFLAG_WEAK)
+
+/* used by the tracers, returns true if the pointer *pp refers to should be
+ * followed and copied, otherwise *pp is left as what should be stored in
+ * its place. */
+static inline bool
+_yoink_follow(void **pp)
+{
+        void *p = *pp;
+        if (!p || ((uintptr_t)p & 1))
+                return false;
+        struct header *head = (struct header *)((char *)p - offsetof(struct header, data));
+        if (head->flags & YFLAG_NULL_SELF) {
+                *pp = NULL;
+                return false;
+        }
+        return !(head->flags & YFLAG_ALIAS_SELF);
+}
+
+/* clear the pointers of a copy if its children are not to be copied,
+ * returns true if they were cleared. */
+static inline bool
+_yoink_null_children(struct header *head)
+{
+        if (!(head->flags & YFLAG_NULL_CHILDREN))
+                return false;
+        memset(head->data + _head_bptrs(head), 0, _head_nptrs(head) * sizeof(void *));
+        return true;
+}
+
+/* weak objects are collected while tracing and fixed up once it is done,
+ * _yoink_resolve forwards through a table of source object -> copy. */
+void _yoink_weak_fixup(Arena *arena, rb_t *weak, void *(*resolve)(void *arg, void *p), void *arg);
+struct _yoink_weak {
+        Arena *to;
+        HashTable *ht;
+};
+void *_yoink_resolve(void *arg, void *p);
+
+#endif /* end of include guard: YOINK_TRACE_H */